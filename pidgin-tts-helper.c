@@ -0,0 +1,409 @@
+/*
+ * File:        pidgin-tts-helper.c
+ * Author:      Thomas Gläßle
+ * License:     free
+ *
+ * Description:
+ * Speech synthesis helper for the pidgin-tts plugin. Utterances arrive
+ * through the shared memory ring buffers described in ptts-ring.h, are
+ * synthesized with libespeak and played by a single long-running player
+ * process, or sent back as PCM. Running the synthesizer out of process
+ * keeps Pidgin alive if it crashes.
+ *
+ * Sender names are rendered once per voice and rate into a bounded cache
+ * of PCM clips, which is warmed while there is nothing else to say.
+ *
+ * Usage:
+ *  pidgin-tts-helper <shm fd> <request eventfd> <response eventfd> [<player>]
+ *
+ * The player command is run through the shell and receives raw signed
+ * 16 bit mono samples on stdin. A %d in it is replaced by the sample rate.
+ */
+
+# ifdef _WIN32
+#   error "This will probably not work on Windows!"
+# endif
+
+// system includes {{{1
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <errno.h>
+# include <signal.h>
+# include <poll.h>
+# include <sys/mman.h>      // mmap
+# include <sys/prctl.h>     // PR_SET_PDEATHSIG
+# include <sys/stat.h>      // fstat
+
+# include <espeak/speak_lib.h>
+
+# include "ptts-ring.h"
+
+// settings {{{1
+# define DEFAULT_PLAYER         "aplay -q -t raw -f S16_LE -c 1 -r %d"
+# define SYNTH_BUFFER_MS        200
+# define RESPOND_RETRIES        1000
+# define RESPOND_WAIT_US        1000
+# define RESPOND_CHUNK          8192        // samples per PCM record
+# define CLIP_CACHE_BYTES       (4*1024*1024)
+
+// state {{{1
+static struct ptts_shm *shm;
+static int request_fd, response_fd;
+static int sample_rate;
+
+static const char *player_command = DEFAULT_PLAYER;
+static FILE *player;
+
+static struct ptts_msg current;
+static char voice[64];
+
+// name clips, most recently used first
+struct clip {
+    struct clip *prev, *next;
+    char *who, *voice;
+    int rate;
+    short *samples;
+    int count;
+};
+
+static struct clip *clips_head, *clips_tail, *capture;
+static size_t clips_bytes;
+
+// names to render when idle
+struct warm {
+    struct warm *next;
+    char *who, *name;
+};
+
+static struct warm *warm_head, **warm_tail = &warm_head;
+
+// Responses {{{1
+static void respond(const struct ptts_msg *msg, const void *data, uint32_t len)
+{
+    uint64_t one = 1;
+    int tries;
+
+    // the plugin drains the ring from its main loop, give it some time
+    for (tries = 0; !ptts_ring_push(shm, &shm->response, msg, sizeof(*msg), data, len); ++tries) {
+        if (tries >= RESPOND_RETRIES)
+            return;
+        usleep(RESPOND_WAIT_US);
+    }
+
+    if (write(response_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        exit(1);
+}
+
+// Audio output {{{1
+static void player_close()
+{
+    if (player != NULL) {
+        pclose(player);
+        player = NULL;
+    }
+}
+
+static void play(const short *samples, int count)
+{
+    char command[1024];
+
+    if (player == NULL) {
+        snprintf(command, sizeof(command), player_command, sample_rate);
+        player = popen(command, "w");
+        if (player == NULL)
+            return;
+    }
+
+    if (fwrite(samples, sizeof(short), count, player) != (size_t) count
+            || fflush(player) != 0)
+        player_close();     // restarted with the next chunk
+}
+
+// samples for the current utterance go to the player or back to the plugin
+static void output(const short *samples, int count)
+{
+    struct ptts_msg msg;
+    int n;
+
+    if (!(current.flags & PTTS_FLAG_PCM)) {
+        play(samples, count);
+        return;
+    }
+
+    msg.type = PTTS_MSG_PCM;
+    msg.id = current.id;
+    msg.flags = 0;
+    msg.arg = sample_rate;
+    for ( ; count > 0; samples += n, count -= n) {
+        n = count < RESPOND_CHUNK ? count : RESPOND_CHUNK;
+        respond(&msg, samples, n * sizeof(short));
+    }
+}
+
+static int synth_callback(short *samples, int count, espeak_EVENT *events)
+{
+    struct clip *clip = capture;
+
+    if (samples == NULL || count <= 0)
+        return 0;
+
+    if (clip != NULL) {
+        clip->samples = realloc(clip->samples, (clip->count + count) * sizeof(short));
+        memcpy(clip->samples + clip->count, samples, count * sizeof(short));
+        clip->count += count;
+        return 0;
+    }
+
+    // the plugin interrupts the current utterance for a keyword hit
+    if (__atomic_load_n(&shm->cancel, __ATOMIC_ACQUIRE) == current.id)
+        return 1;
+
+    output(samples, count);
+    return 0;
+}
+
+// Name clips {{{1
+static void clip_unlink(struct clip *clip)
+{
+    if (clip->prev)
+        clip->prev->next = clip->next;
+    else
+        clips_head = clip->next;
+    if (clip->next)
+        clip->next->prev = clip->prev;
+    else
+        clips_tail = clip->prev;
+    clip->prev = clip->next = NULL;
+}
+
+static void clip_link(struct clip *clip)
+{
+    clip->next = clips_head;
+    if (clips_head)
+        clips_head->prev = clip;
+    else
+        clips_tail = clip;
+    clips_head = clip;
+}
+
+static void clip_free(struct clip *clip)
+{
+    clip_unlink(clip);
+    clips_bytes -= clip->count * sizeof(short);
+    free(clip->who);
+    free(clip->voice);
+    free(clip->samples);
+    free(clip);
+}
+
+// clip of who in the current voice and rate
+static struct clip* clip_find(const char *who)
+{
+    int rate = espeak_GetParameter(espeakRATE, 1);
+    struct clip *clip;
+
+    for (clip = clips_head; clip; clip = clip->next)
+        if (clip->rate == rate && strcmp(clip->who, who) == 0 && strcmp(clip->voice, voice) == 0) {
+            clip_unlink(clip);
+            clip_link(clip);
+            return clip;
+        }
+    return NULL;
+}
+
+static struct clip* clip_render(const char *who, const char *name)
+{
+    struct clip *clip = calloc(1, sizeof(*clip));
+
+    if (clip == NULL)
+        return NULL;
+
+    clip->who = strdup(who);
+    clip->voice = strdup(voice);
+    clip->rate = espeak_GetParameter(espeakRATE, 1);
+
+    capture = clip;
+    espeak_Synth(name, strlen(name) + 1, 0, POS_CHARACTER, 0, espeakCHARS_AUTO, NULL, NULL);
+    capture = NULL;
+
+    clip_link(clip);
+    clips_bytes += clip->count * sizeof(short);
+    while (clips_bytes > CLIP_CACHE_BYTES && clips_tail != clip)
+        clip_free(clips_tail);
+    return clip;
+}
+
+static void clip_evict(const char *who)
+{
+    struct clip *clip, *next;
+    for (clip = clips_head; clip; clip = next) {
+        next = clip->next;
+        if (strcmp(clip->who, who) == 0)
+            clip_free(clip);
+    }
+}
+
+static void warm_push(const char *who, const char *name)
+{
+    struct warm *warm = calloc(1, sizeof(*warm));
+    if (warm == NULL)
+        return;
+    warm->who = strdup(who);
+    warm->name = strdup(name);
+    *warm_tail = warm;
+    warm_tail = &warm->next;
+}
+
+// render the next name that is not cached yet, while the cache has room
+static void warm_next()
+{
+    struct warm *warm = warm_head;
+
+    warm_head = warm->next;
+    if (warm_head == NULL)
+        warm_tail = &warm_head;
+
+    if (clips_bytes < CLIP_CACHE_BYTES && clip_find(warm->who) == NULL)
+        clip_render(warm->who, warm->name);
+
+    free(warm->who);
+    free(warm->name);
+    free(warm);
+}
+
+// Requests {{{1
+static void handle(const unsigned char *record, uint32_t len)
+{
+    struct ptts_msg msg;
+    struct clip *clip;
+    char *data, *who, *name, *text;
+    size_t size;
+
+    if (len < sizeof(msg))
+        return;
+
+    memcpy(&msg, record, sizeof(msg));
+    size = len - sizeof(msg);
+    data = malloc(size + 3);
+    if (data == NULL)
+        return;
+    memcpy(data, record + sizeof(msg), size);
+    memset(data + size, 0, 3);
+
+    // up to three strings
+    who = data;
+    name = who + strlen(who) + 1;
+    text = name + strlen(name) + 1;
+
+    switch (msg.type) {
+        case PTTS_MSG_VOICE:
+            espeak_SetVoiceByName(who);
+            espeak_SetParameter(espeakVOLUME, msg.arg, 0);
+            snprintf(voice, sizeof(voice), "%s", who);
+            break;
+
+        case PTTS_MSG_SPEAK:
+            current = msg;
+            msg.arg = 0;
+            if (msg.flags & PTTS_FLAG_SENDER) {
+                clip = clip_find(who);
+                msg.arg = clip ? PTTS_DONE_CLIP_HIT : PTTS_DONE_CLIP_MISS;
+                if (clip == NULL)
+                    clip = clip_render(who, name);
+                if (clip != NULL)
+                    output(clip->samples, clip->count);
+            }
+            else
+                text = who;
+            espeak_Synth(text, strlen(text) + 1, 0, POS_CHARACTER, 0, espeakCHARS_AUTO, NULL, NULL);
+            msg.type = PTTS_MSG_DONE;
+            respond(&msg, NULL, 0);
+            break;
+
+        case PTTS_MSG_WARM:
+            warm_push(who, name);
+            break;
+
+        case PTTS_MSG_EVICT:
+            clip_evict(who);
+            break;
+    }
+
+    free(data);
+}
+
+// Main {{{1
+int main(int argc, char **argv)
+{
+    const void *record;
+    struct pollfd fds[2];
+    struct stat st;
+    pid_t parent = getppid();
+    uint64_t count;
+    uint32_t len;
+    int shm_fd, n;
+
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <shm fd> <request eventfd> <response eventfd> [<player>]\n", argv[0]);
+        return 2;
+    }
+
+    shm_fd = atoi(argv[1]);
+    request_fd = atoi(argv[2]);
+    response_fd = atoi(argv[3]);
+    if (argc > 4)
+        player_command = argv[4];
+
+    // go away together with pidgin, also if it died before the signal was set
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    if (fstat(shm_fd, &st) < 0 || (size_t) st.st_size < sizeof(struct ptts_shm))
+        return 1;
+    shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED
+            || shm->magic != PTTS_SHM_MAGIC
+            || shm->version != PTTS_SHM_VERSION
+            || shm->size > (uint64_t) st.st_size)
+        return 1;
+
+    sample_rate = espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, SYNTH_BUFFER_MS, NULL, 0);
+    if (sample_rate < 0)
+        return 1;
+    espeak_SetSynthCallback(synth_callback);
+
+    // the plugin never writes to stdin, it is readable once pidgin closed it
+    fds[0].fd = request_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        // block only if there are no names to warm up
+        n = poll(fds, 2, warm_head ? 0 : -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (fds[1].revents && read(STDIN_FILENO, &count, sizeof(count)) <= 0))
+            break;
+        if (fds[0].revents && read(request_fd, &count, sizeof(count)) < 0 && errno != EINTR)
+            break;
+
+        while ((record = ptts_ring_peek(shm, &shm->request, &len)) != NULL) {
+            handle(record, len);
+            ptts_ring_consume(&shm->request, len);
+        }
+
+        if (warm_head != NULL)
+            warm_next();
+    }
+
+    player_close();
+    espeak_Terminate();
+    return 0;
+}
+// 1}}}
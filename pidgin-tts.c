@@ -29,15 +29,20 @@
 #  endif /* __GNUC__ >= 4 */
 # endif /* G_GNUC_NULL_TERMINATED */
 # define PURPLE_PLUGINS
+# define _GNU_SOURCE        // memfd_create
 
 // purple includes {{{2
 # include <pidgin/gtkplugin.h>       // gtk stuff
+# include <pidgin/gtkconv.h>         // pidgin_conversations_get_handle
+# include <libpurple/blist.h>        // purple_blist_xxx, purple_buddy_xxx
 # include <libpurple/cmds.h>         // purple_cmd_xxx
 # include <libpurple/conversation.h> // purple_conversation_xxx
 # include <libpurple/debug.h>        // purple_debug_xxx
 # include <libpurple/prefs.h>        // purple_pref_xxx
+# include <libpurple/savedstatuses.h> // purple_savedstatus_xxx
 # include <libpurple/signals.h>      // purple_signal_xxx, ...
 # include <libpurple/util.h>         // purple_str_xxx
+# include <libpurple/eventloop.h>    // purple_timeout_xxx
 # include <libpurple/version.h>
 
 // system includes {{{2
@@ -46,7 +51,21 @@
 # include <string.h>
 # include <unistd.h>        // write, close
 # include <errno.h>
+# include <signal.h>        // kill
+# include <fcntl.h>         // open
+# include <sys/mman.h>      // mmap
+# include <sys/stat.h>      // fstat
+# include <sys/uio.h>       // writev
+# include <sys/eventfd.h>   // eventfd
+# include <sys/socket.h>    // socket, send
+# include <sys/un.h>        // sockaddr_un
 # include <sys/types.h>
+# include <dlfcn.h>         // dlsym
+# include <poll.h>          // poll
+
+// local includes {{{2
+# include "ptts-ring.h"     // helper process shared memory
+# include "ptts-scan.h"     // vectorized byte scanner
 
 // plugin info {{{2
 # define PLUGIN_ID      "qjuh-pidgin-tts"
@@ -56,8 +75,14 @@
 # define PREFS_BASE     "/plugins/core/pidgin-tts"
 # define PREFS_ACTIVE   PREFS_BASE "/active"
 # define PREFS_SHELL    PREFS_BASE "/shell"
+# define PREFS_IDLE     PREFS_BASE "/idle-timeout"
+# define PREFS_PREWARM  PREFS_BASE "/prewarm"
+# define PREFS_FOCUS    PREFS_BASE "/suppress-focused"
+# define PREFS_ACTIVITY PREFS_BASE "/suppress-activity"
+# define PREFS_METRICS  PREFS_BASE "/metrics-socket"
 
 # define PREFS_BUDDY    PREFS_BASE "/buddy/%s"
+# define PREFS_PATH_MAX 256
 
 # define PREFS_PROFILE  PREFS_BASE    "/profile"
 # define PREFS_PROFILES PREFS_BASE    "/profile/%s"
@@ -66,12 +91,26 @@
 # define PREFS_LANGUAGE PREFS_PROFILES  "/language"
 # define PREFS_VOLUME   PREFS_PROFILES  "/volume"
 # define PREFS_REPLACE  PREFS_PROFILES  "/replace"
+# define PREFS_REGEX    PREFS_PROFILES  "/replace-regex"
 # define PREFS_KEYWORDS PREFS_PROFILES  "/keywords"
 # define PREFS_KEYS_ON  PREFS_PROFILES  "/keywords-active"
+# define PREFS_KEYS_INT PREFS_PROFILES  "/keywords-interrupt"
+# define PREFS_ANNOUNCE PREFS_PROFILES  "/announce"
+# define PREFS_DICT     PREFS_PROFILES  "/dictionary"
+# define PREFS_BACKEND  PREFS_PROFILES  "/backend"
+# define PREFS_SOCKET   PREFS_PROFILES  "/socket"
+# define PREFS_CONDENSE_URLS  PREFS_PROFILES  "/condense-urls"
+# define PREFS_CONDENSE_CODE  PREFS_PROFILES  "/condense-code"
+# define PREFS_CONDENSE_EMOJI PREFS_PROFILES  "/condense-emoji"
 
 // default settings {{{2
 # define DEFAULT_ACTIVE         TRUE
 # define DEFAULT_SHELL          "/bin/sh"
+# define DEFAULT_IDLE_TIMEOUT   300
+# define DEFAULT_PREWARM        TRUE
+# define DEFAULT_FOCUS          FALSE
+# define DEFAULT_ACTIVITY       0
+# define DEFAULT_METRICS        ""          // no metrics socket
 # define DEFAULT_PROFILE        PROFILE_ESPEAK
 
 // profiles
@@ -81,8 +120,32 @@
 # define PROFILE_ESPEAK_LANGUAGE    "de"
 # define PROFILE_ESPEAK_VOLUME      "200"
 # define PROFILE_ESPEAK_REPLACE     NULL
+# define PROFILE_ESPEAK_REGEX       NULL
 # define PROFILE_ESPEAK_KEYWORDS    NULL
 # define PROFILE_ESPEAK_KEYS_ON     FALSE
+# define PROFILE_ESPEAK_KEYS_INT    FALSE
+# define PROFILE_ESPEAK_ANNOUNCE    FALSE
+# define PROFILE_ESPEAK_DICT        ""
+# define PROFILE_ESPEAK_BACKEND     BACKEND_SHELL_NAME
+# define PROFILE_ESPEAK_SOCKET      ""
+# define PROFILE_ESPEAK_CONDENSE    FALSE
+
+// speech-dispatcher, or any other server speaking SSIP. An empty socket
+// means the speech-dispatcher default from the environment.
+# define PROFILE_SPEECHD            "speechd"
+# define PROFILE_SPEECHD_BACKEND    BACKEND_SSIP_NAME
+
+// backends
+# define BACKEND_SHELL_NAME         "shell"
+# define BACKEND_HELPER_NAME        "helper"
+# define BACKEND_HELPER_BINARY      "pidgin-tts-helper"
+# define BACKEND_HELPER_REQUESTS    (256*1024)
+# define BACKEND_HELPER_RESPONSES   (1024*1024)
+# define BACKEND_QUEUE_MAX          256         // waiting messages before new ones are dropped
+# define BACKEND_SSIP_NAME          "ssip"
+# define BACKEND_SSIP_SOCKET        "speech-dispatcher/speechd.sock"
+# define BACKEND_SSIP_RETRY         5           // seconds between connection attempts
+# define BACKEND_SSIP_BACKLOG       (64*1024)   // unsent bytes before messages are dropped
 
 // commands {{{2
 # define CMD_TTS                "tts"
@@ -95,12 +158,29 @@
 # define CMD_COMPOSE            "compose"
 # define CMD_LANGUAGE           "lang"
 # define CMD_REPLACE            "replace"
+# define CMD_REPLACE_REGEX      "-r"
 # define CMD_VOLUME             "volume"
 # define CMD_EXTRA              "param"
 # define CMD_STATUS             "status"
 # define CMD_PROFILE            "profile"
 # define CMD_TEST               "test"
 # define CMD_SAY                "say"
+# define CMD_IDLE               "idle"
+# define CMD_FOCUS              "focus"
+# define CMD_ACTIVITY           "activity"
+# define CMD_METRICS            "metrics"
+# define CMD_BACKEND            "backend"
+# define CMD_SOCKET             "socket"
+# define CMD_STOP               "stop"
+# define CMD_ANNOUNCE           "announce"
+
+// sender announcement, for backends without name clips
+# define ANNOUNCE_FORMAT        "%s: %s"
+
+# define CMD_CONDENSE           "condense"
+# define CMD_CONDENSE_URLS      "urls"
+# define CMD_CONDENSE_CODE      "code"
+# define CMD_CONDENSE_EMOJI     "emoji"
 
 # define CMD_KEYWORD            "keyword"
 # define CMD_KEYWORD_ENABLE     CMD_ENABLE
@@ -108,35 +188,114 @@
 # define CMD_KEYWORD_LIST       "list"
 # define CMD_KEYWORD_ADD        "add"
 # define CMD_KEYWORD_REMOVE     "remove"
+# define CMD_KEYWORD_INTERRUPT  "interrupt"
+
+// keywords starting with this character always interrupt
+# define KEYWORD_INTERRUPT      '!'
+
+# define CMD_IMPORT             "import"
+# define CMD_EXPORT             "export"
+
+# define CMD_DICT               "dict"
+# define CMD_DICT_COMPILE       "compile"
+# define CMD_DICT_DISABLE       CMD_DISABLE
+
+# define CMD_RECORD             "record"
+# define CMD_RECORD_STOP        CMD_DISABLE
+# define CMD_REPLAY             "replay"
+# define CMD_REPLAY_MAX         "max"
+# define CMD_SINK               "sink"
+# define CMD_SINK_SHELL         "shell"
+# define CMD_SINK_NULL          "null"
+# define CMD_SINK_WAV           "wav"
 
 # define CMD_CONV               "buddy"
 # define CMD_CONV_ENABLE        CMD_ENABLE
 # define CMD_CONV_DISABLE       CMD_DISABLE
+# define CMD_CONV_PROFILE       CMD_PROFILE
+
+// presence {{{2
+# define SPEECH_CHARS_PER_SECOND    15.0    // to estimate the speech that was saved
+
+// message traces {{{2
+# define TRACE_MAGIC            "PTTSTRC1"
+# define TRACE_MAGIC_LEN        8
+# define TRACE_REPLAY_BATCH     64
+
+// condensation {{{2
+# define CONDENSE_URLS          1
+# define CONDENSE_CODE          2
+# define CONDENSE_EMOJI         4
+# define CONDENSE_FENCE         "```"
+# define CONDENSE_CODE_LINES    3           // code-like lines that make a block
+# define CONDENSE_RUN_MIN       16          // hex digits in an id or hash
+# define CONDENSE_BASE64_MIN    24
+# define CONDENSE_CODE_TEXT     "code block"
+# define CONDENSE_HEX_TEXT      "hex value"
+# define CONDENSE_BASE64_TEXT   "encoded data"
+
+// message arena {{{2
+# define ARENA_CHUNK            (16*1024)
+# define ARENA_ALIGN(n)         (((n) + 7) & ~(gsize) 7)
+# define MALLOC_COUNT_LIBRARY   "ptts-malloc-count.so"
+# define MALLOC_COUNT_SYMBOL    "ptts_malloc_count"
+
+// metrics {{{2
+# define METRICS_BUCKETS        32          // latency histogram, powers of two microseconds
+# define METRICS_BACKLOG        4
+# define METRICS_TIMEOUT        1000        // milliseconds to wait for a request
+# define METRICS_REQUEST_MAX    256
+
+// compiled dictionaries {{{2
+# define DICT_MAGIC             "PTTSDICT"
+# define DICT_MAGIC_LEN         8
+# define DICT_VERSION           1
+# define DICT_FANOUT            256
 
 // forward declarations {{{2
 static void ptts_plugin_init(PurplePlugin *plugin);
 static gboolean ptts_plugin_load(PurplePlugin *plugin);
 static gboolean ptts_plugin_unload(PurplePlugin * plugin);
+static gboolean process_message(PurpleAccount *account, PurpleConversation *conv, const gchar *who, const gchar* message, gboolean live);
 
 // instance variables {{{2
 static PurplePlugin *ptts_instance;
 
-// file descriptors
-static int
-    ptts_queue_stdin,
-    ptts_queue_pid;
+// profile name => struct backend
+static GHashTable *ptts_backends;
+static struct backend *ptts_backend;
 
 // command ids
 static int
     ptts_command_id_global,
     ptts_command_id_conversation,
     ptts_command_id_keyword,
-    ptts_command_id_replace;
+    ptts_command_id_replace,
+    ptts_command_id_trace,
+    ptts_command_id_dict,
+    ptts_command_id_condense;
+
+// bytes that need the markup parser, and bytes removed before speaking
+static struct ptts_scan scan_markup, scan_strip;
+
+// output sink, used to benchmark against a null or WAV backend
+static enum {
+    SINK_SHELL,
+    SINK_NULL,
+    SINK_WAV
+} ptts_sink;
+
+static int ptts_sink_null = -1;
+static gchar *ptts_sink_path;
+static guint ptts_sink_count;
 
 static GList
     *active_conversations,
     *inactive_conversations;
 
+// PurpleConversation => struct backend
+static GHashTable *conv_backends;
+
 // Export plugin {{{1
 static PurplePluginInfo pluginInfo =
 {
@@ -218,7 +377,7 @@ GPid spawn(const gchar *cmd, const gchar *opts[], int copts, int *infp, int *out
             NULL,           // inherit current working directory
             opt,            // argv
             NULL,           // envp
-            G_SPAWN_STDOUT_TO_DEV_NULL|G_SPAWN_STDERR_TO_DEV_NULL,
+            (outfp ? 0 : G_SPAWN_STDOUT_TO_DEV_NULL)|G_SPAWN_STDERR_TO_DEV_NULL,
             NULL,           // SetupFunction
             NULL,           // USERDATA
             &pid,           // child PID
@@ -235,6 +394,118 @@ GPid spawn(const gchar *cmd, const gchar *opts[], int copts, int *infp, int *out
     return pid;
 }
 
+// non-negative numbers from commands, anything else is rejected
+gboolean parse_seconds(const gchar *str, gint *value)
+{
+    gchar *end;
+    long number;
+
+    errno = 0;
+    number = strtol(str, &end, 10);
+    if (end == str || *end != 0 || errno != 0 || number < 0 || number > G_MAXINT)
+        return FALSE;
+    *value = number;
+    return TRUE;
+}
+
+// file names from commands, with a leading ~/ meaning the home directory
+gchar* expand_path(const gchar *path)
+{
+    if (path[0] == '~' && (path[1] == '/' || path[1] == 0))
+        return g_build_filename(g_get_home_dir(), path + 1, NULL);
+    return g_strdup(path);
+}
+
+FILE* open_path(const gchar *path, const gchar *mode)
+{
+    gchar *expanded = expand_path(path);
+    FILE *file = fopen(expanded, mode);
+    g_free(expanded);
+    return file;
+}
+
+// tabs, newlines and backslashes in fields are escaped, and so is a # that
+// would start a comment
+void tsv_write_field(FILE *file, const gchar *field)
+{
+    const gchar *p;
+
+    if (field[0] == '#')
+        fputc('\\', file);
+    for (p = field; *p; ++p) {
+        if (*p == '\t')
+            fputs("\\t", file);
+        else if (*p == '\n')
+            fputs("\\n", file);
+        else if (*p == '\\')
+            fputs("\\\\", file);
+        else
+            fputc(*p, file);
+    }
+}
+
+static void tsv_unescape(gchar *field)
+{
+    gchar *out = field;
+
+    for ( ; *field; ++field) {
+        if (field[0] == '\\' && field[1] && strchr("tn\\#", field[1])) {
+            ++field;
+            *out++ = *field == 't' ? '\t' : *field == 'n' ? '\n' : *field;
+        }
+        else
+            *out++ = *field;
+    }
+    *out = 0;
+}
+
+// read a tab separated file, calling func for every line that is neither
+// empty nor a comment. Missing trailing fields are passed as empty strings.
+typedef void (*tsv_func)(gchar **fields, gpointer data);
+
+gboolean tsv_read(const gchar *filename, guint columns, tsv_func func, gpointer data)
+{
+    FILE *file;
+    gchar *line = NULL, *field, *tab;
+    gchar **fields;
+    size_t size = 0;
+    ssize_t len;
+    guint i;
+
+    file = open_path(filename, "r");
+    if (file == NULL) {
+        purple_debug_error(PLUGIN_NAME, "Cannot read %s: '%s'\n", filename, strerror(errno));
+        return FALSE;
+    }
+
+    fields = g_new(gchar*, columns);
+    while ((len = getline(&line, &size, file)) >= 0) {
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = 0;
+        if (len == 0 || line[0] == '#')
+            continue;
+
+        for (i = 0, field = line; i < columns; ++i) {
+            fields[i] = field;
+            tab = i+1 < columns ? strchr(field, '\t') : NULL;
+            if (tab != NULL) {
+                *tab = 0;
+                field = tab + 1;
+            }
+            else
+                field += strlen(field);
+        }
+        for (i = 0; i < columns; ++i)
+            tsv_unescape(fields[i]);
+        func(fields, data);
+    }
+
+    free(line);
+    fclose(file);
+    g_free(fields);
+    return TRUE;
+}
+
 
 gboolean is_valid_language(const char* lang)
 {
@@ -295,23 +566,586 @@ gchar* detect_language()
 }
 
 
+// Message arena {{{1
+// analyse() and tts() take the memory they need for a message from a bump
+// allocator that is reset once the message is spoken or queued. Chunks are
+// kept across messages, and merged into one at a reset when a message
+// needed more than one, so once the arena has seen the largest message,
+// the arena itself does not touch the heap. Whether anything else does is
+// measured with ptts-malloc-count.so, which counts real allocations.
+struct arena_chunk {
+    struct arena_chunk *next;       // older chunks
+    gsize size, used;
+    gchar data[];
+};
+
+struct arena {
+    struct arena_chunk *chunk;
+    gsize size;                     // bytes in all chunks
+    guint64 messages;
+    guint64 mallocs;                // heap allocations for all messages
+    guint64 mallocs_begin;          // counter when the current one began
+    guint64 mallocs_last;           // for the last one
+};
+
+// a position to give allocations back to
+struct arena_mark {
+    struct arena_chunk *chunk;
+    gsize used;
+};
+
+static struct arena ptts_arena;
+
+// from ptts-malloc-count.so, NULL if it is not preloaded
+static guint64 (*ptts_malloc_count)(void);
+
+/* allocation {{{2 */
+
+static void arena_grow(struct arena *arena, gsize size)
+{
+    struct arena_chunk *chunk;
+
+    // the arena at least doubles, so growing is rare
+    size = MAX(size, MAX(ARENA_CHUNK, arena->size));
+    chunk = g_malloc(sizeof(*chunk) + size);
+    chunk->next = arena->chunk;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->chunk = chunk;
+    arena->size += size;
+}
+
+static gpointer arena_alloc(struct arena *arena, gsize size)
+{
+    struct arena_chunk *chunk = arena->chunk;
+    gsize offset = chunk ? ARENA_ALIGN(chunk->used) : 0;
+
+    if (chunk == NULL || offset > chunk->size || size > chunk->size - offset) {
+        arena_grow(arena, size);
+        chunk = arena->chunk;
+        offset = 0;
+    }
+    chunk->used = offset + size;
+    return chunk->data + offset;
+}
+
+static void arena_free(struct arena *arena)
+{
+    struct arena_chunk *chunk, *next;
+
+    for (chunk = arena->chunk; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        g_free(chunk);
+    }
+    arena->chunk = NULL;
+    arena->size = 0;
+}
+
+// a message starts, heap allocations are counted from here
+static void arena_begin(struct arena *arena)
+{
+    if (ptts_malloc_count != NULL)
+        arena->mallocs_begin = ptts_malloc_count();
+}
+
+// everything allocated for the message is gone
+static void arena_reset(struct arena *arena)
+{
+    gsize size = arena->size;
+
+    if (arena->chunk != NULL && arena->chunk->next != NULL) {
+        arena_free(arena);
+        arena_grow(arena, size);
+    }
+    if (arena->chunk != NULL)
+        arena->chunk->used = 0;
+
+    arena->messages++;
+    if (ptts_malloc_count != NULL) {
+        arena->mallocs_last = ptts_malloc_count() - arena->mallocs_begin;
+        arena->mallocs += arena->mallocs_last;
+    }
+}
+
+// callers that may run outside a message, e.g. from a signal or when the
+// backend finished, give back what they took. A chunk grown meanwhile stays
+// until the next reset merges it.
+static struct arena_mark arena_mark(struct arena *arena)
+{
+    struct arena_mark mark = { arena->chunk, arena->chunk ? arena->chunk->used : 0 };
+    return mark;
+}
+
+static void arena_release(struct arena *arena, struct arena_mark mark)
+{
+    if (arena->chunk != NULL && arena->chunk == mark.chunk)
+        arena->chunk->used = mark.used;
+}
+
+/* strings {{{2 */
+static gchar* arena_strndup(struct arena *arena, const gchar *str, gsize len)
+{
+    gchar *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = 0;
+    return copy;
+}
+
+static gchar* arena_printf(struct arena *arena, const gchar *format, ...) __attribute__((format(printf,2,3)));
+static gchar* arena_printf(struct arena *arena, const gchar *format, ...)
+{
+    va_list ap;
+    gchar *str;
+    int len;
+
+    va_start(ap, format);
+    len = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+
+    str = arena_alloc(arena, len + 1);
+    va_start(ap, format);
+    vsnprintf(str, len + 1, format, ap);
+    va_end(ap);
+    return str;
+}
+
+// a string that grows at the top of the arena, in place while it is the
+// last thing allocated
+struct arena_string {
+    struct arena *arena;
+    gchar *str;
+    gsize len, size;
+};
+
+static void arena_string_init(struct arena_string *string, struct arena *arena, gsize size)
+{
+    string->arena = arena;
+    string->size = size + 1;
+    string->str = arena_alloc(arena, string->size);
+    string->str[0] = 0;
+    string->len = 0;
+}
+
+static void arena_string_reserve(struct arena_string *string, gsize len)
+{
+    struct arena_chunk *chunk = string->arena->chunk;
+    gsize size = MAX(2 * string->size, string->len + len + 1);
+    gchar *str;
+
+    if (string->len + len < string->size)
+        return;
+
+    if (string->str + string->size == chunk->data + chunk->used
+            && size <= chunk->size - (string->str - chunk->data)) {
+        chunk->used += size - string->size;
+        string->size = size;
+        return;
+    }
+
+    str = arena_alloc(string->arena, size);
+    memcpy(str, string->str, string->len + 1);
+    string->str = str;
+    string->size = size;
+}
+
+static void arena_string_append_len(struct arena_string *string, const gchar *str, gsize len)
+{
+    arena_string_reserve(string, len);
+    memcpy(string->str + string->len, str, len);
+    string->len += len;
+    string->str[string->len] = 0;
+}
+
+static void arena_string_append(struct arena_string *string, const gchar *str)
+{
+    arena_string_append_len(string, str, strlen(str));
+}
+
+static void arena_string_append_c(struct arena_string *string, gchar c)
+{
+    arena_string_append_len(string, &c, 1);
+}
+
+/* logging {{{2 */
+static void arena_log(PurpleConversation *conv, const struct arena *arena)
+{
+    if (ptts_malloc_count != NULL)
+        systemlog(conv,
+                "%s message arena: %" G_GSIZE_FORMAT " KB, %" G_GUINT64_FORMAT " heap allocations for %" G_GUINT64_FORMAT " messages, %" G_GUINT64_FORMAT " for the last one",
+                PLUGIN_NAME,
+                arena->size / 1024,
+                arena->mallocs,
+                arena->messages,
+                arena->mallocs_last);
+    else
+        systemlog(conv,
+                "%s message arena: %" G_GSIZE_FORMAT " KB for %" G_GUINT64_FORMAT " messages, heap allocations are counted with " MALLOC_COUNT_LIBRARY " preloaded",
+                PLUGIN_NAME,
+                arena->size / 1024,
+                arena->messages);
+}
+
+
+// Metrics {{{1
+// Counters are updated atomically from the UI thread. When a socket is
+// configured, a thread of its own serves them to local monitoring agents,
+// so reading them never waits for the UI. A client sends one line, "json"
+// or anything else for Prometheus text, or a plain HTTP GET of /json or
+// /metrics, and the connection is closed after the answer.
+enum stage {
+    STAGE_FILTER,       // keywords and presence, before analyse()
+    STAGE_ANALYSE,
+    STAGE_DISPATCH,     // handing the text to the backend
+    STAGE_SPEECH,       // until the helper or shell reports it done
+    STAGES
+};
+
+static const gchar *stage_names[STAGES] = { "filter", "analyse", "dispatch", "speech" };
+
+// powers of two microseconds
+struct histogram {
+    guint64 count, sum;
+    guint64 bucket[METRICS_BUCKETS];
+};
+
+static struct {
+    guint64 received, suppressed, filtered, spoken, dropped;
+    gint64 queued;                      // waiting in the backend lanes
+    guint64 backend_starts;
+    guint64 profile_hits, profile_misses;
+    guint64 clip_hits, clip_misses;
+    struct histogram stage[STAGES];
+} ptts_metrics;
+
+# define METRIC_ADD(NAME, N)    __atomic_add_fetch(&ptts_metrics.NAME, (N), __ATOMIC_RELAXED)
+# define METRIC_GET(NAME)       __atomic_load_n(&ptts_metrics.NAME, __ATOMIC_RELAXED)
+
+struct metrics_server {
+    gchar *path;
+    int listen_fd, wake_fd;
+    gint stopping;
+    GThread *thread;
+};
+
+static struct metrics_server *ptts_metrics_server;
+
+/* recording {{{2 */
+static void metrics_observe(enum stage stage, gint64 usec)
+{
+    struct histogram *histogram = &ptts_metrics.stage[stage];
+    guint bucket = usec > 0 ? 64 - __builtin_clzll(usec) : 0;
+
+    bucket = MIN(bucket, METRICS_BUCKETS - 1);
+    __atomic_add_fetch(&histogram->bucket[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum, usec > 0 ? usec : 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+}
+
+// upper bound of the q quantile in microseconds, from a snapshot
+static guint64 metrics_quantile(const guint64 *bucket, guint64 count, gdouble q)
+{
+    guint64 rank = (guint64) (q * count + 0.5), seen = 0;
+    guint i;
+
+    for (i = 0; i < METRICS_BUCKETS; ++i) {
+        seen += bucket[i];
+        if (seen >= MAX(rank, 1))
+            return (guint64) 1 << i;
+    }
+    return (guint64) 1 << (METRICS_BUCKETS - 1);
+}
+
+/* formats {{{2 */
+static void metrics_snapshot(enum stage stage, guint64 *bucket, guint64 *count, guint64 *sum)
+{
+    struct histogram *histogram = &ptts_metrics.stage[stage];
+    guint i;
+
+    *count = 0;
+    for (i = 0; i < METRICS_BUCKETS; ++i)
+        *count += bucket[i] = __atomic_load_n(&histogram->bucket[i], __ATOMIC_RELAXED);
+    *sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+}
+
+static gdouble metrics_rate(guint64 hits, guint64 misses)
+{
+    return hits + misses ? (gdouble) hits / (hits + misses) : 0;
+}
+
+static void metrics_json(GString *out)
+{
+    static const gdouble quantiles[] = { 0.5, 0.9, 0.99 };
+    guint64 bucket[METRICS_BUCKETS], count, sum;
+    guint64 profile_hits = METRIC_GET(profile_hits), profile_misses = METRIC_GET(profile_misses);
+    guint64 clip_hits = METRIC_GET(clip_hits), clip_misses = METRIC_GET(clip_misses);
+    enum stage stage;
+    guint q;
+
+    g_string_append_printf(out,
+            "{\"messages\":{\"received\":%" G_GUINT64_FORMAT ",\"suppressed\":%" G_GUINT64_FORMAT
+            ",\"filtered\":%" G_GUINT64_FORMAT ",\"spoken\":%" G_GUINT64_FORMAT ",\"dropped\":%" G_GUINT64_FORMAT "},"
+            "\"queue_depth\":%" G_GINT64_FORMAT ",\"backend_starts\":%" G_GUINT64_FORMAT ","
+            "\"cache\":{\"profile\":{\"hits\":%" G_GUINT64_FORMAT ",\"misses\":%" G_GUINT64_FORMAT ",\"hit_rate\":%.4f},"
+            "\"name_clip\":{\"hits\":%" G_GUINT64_FORMAT ",\"misses\":%" G_GUINT64_FORMAT ",\"hit_rate\":%.4f}},"
+            "\"latency_us\":{",
+            METRIC_GET(received), METRIC_GET(suppressed), METRIC_GET(filtered),
+            METRIC_GET(spoken), METRIC_GET(dropped),
+            METRIC_GET(queued), METRIC_GET(backend_starts),
+            profile_hits, profile_misses, metrics_rate(profile_hits, profile_misses),
+            clip_hits, clip_misses, metrics_rate(clip_hits, clip_misses));
+
+    for (stage = 0; stage < STAGES; ++stage) {
+        metrics_snapshot(stage, bucket, &count, &sum);
+        g_string_append_printf(out, "%s\"%s\":{\"count\":%" G_GUINT64_FORMAT ",\"sum\":%" G_GUINT64_FORMAT,
+                stage ? "," : "", stage_names[stage], count, sum);
+        for (q = 0; q < G_N_ELEMENTS(quantiles); ++q)
+            g_string_append_printf(out, ",\"p%g\":%" G_GUINT64_FORMAT,
+                    quantiles[q] * 100, count ? metrics_quantile(bucket, count, quantiles[q]) : 0);
+        g_string_append_c(out, '}');
+    }
+    g_string_append(out, "}}\n");
+}
+
+static void metrics_prometheus(GString *out)
+{
+    static const gdouble quantiles[] = { 0.5, 0.9, 0.99 };
+    guint64 bucket[METRICS_BUCKETS], count, sum;
+    enum stage stage;
+    guint q;
+
+    g_string_append_printf(out,
+            "# HELP pidgin_tts_messages_total Messages by what happened to them.\n"
+            "# TYPE pidgin_tts_messages_total counter\n"
+            "pidgin_tts_messages_total{state=\"received\"} %" G_GUINT64_FORMAT "\n"
+            "pidgin_tts_messages_total{state=\"suppressed\"} %" G_GUINT64_FORMAT "\n"
+            "pidgin_tts_messages_total{state=\"filtered\"} %" G_GUINT64_FORMAT "\n"
+            "pidgin_tts_messages_total{state=\"spoken\"} %" G_GUINT64_FORMAT "\n"
+            "pidgin_tts_messages_total{state=\"dropped\"} %" G_GUINT64_FORMAT "\n"
+            "# HELP pidgin_tts_queue_depth Messages waiting for a backend.\n"
+            "# TYPE pidgin_tts_queue_depth gauge\n"
+            "pidgin_tts_queue_depth %" G_GINT64_FORMAT "\n"
+            "# HELP pidgin_tts_backend_starts_total Shells, helpers and speech server connections started.\n"
+            "# TYPE pidgin_tts_backend_starts_total counter\n"
+            "pidgin_tts_backend_starts_total %" G_GUINT64_FORMAT "\n"
+            "# HELP pidgin_tts_cache_requests_total Lookups of compiled profiles and name clips.\n"
+            "# TYPE pidgin_tts_cache_requests_total counter\n"
+            "pidgin_tts_cache_requests_total{cache=\"profile\",result=\"hit\"} %" G_GUINT64_FORMAT "\n"
+            "pidgin_tts_cache_requests_total{cache=\"profile\",result=\"miss\"} %" G_GUINT64_FORMAT "\n"
+            "pidgin_tts_cache_requests_total{cache=\"name_clip\",result=\"hit\"} %" G_GUINT64_FORMAT "\n"
+            "pidgin_tts_cache_requests_total{cache=\"name_clip\",result=\"miss\"} %" G_GUINT64_FORMAT "\n"
+            "# HELP pidgin_tts_stage_seconds Time spent per message in each stage.\n"
+            "# TYPE pidgin_tts_stage_seconds summary\n",
+            METRIC_GET(received), METRIC_GET(suppressed), METRIC_GET(filtered),
+            METRIC_GET(spoken), METRIC_GET(dropped),
+            METRIC_GET(queued), METRIC_GET(backend_starts),
+            METRIC_GET(profile_hits), METRIC_GET(profile_misses),
+            METRIC_GET(clip_hits), METRIC_GET(clip_misses));
+
+    for (stage = 0; stage < STAGES; ++stage) {
+        metrics_snapshot(stage, bucket, &count, &sum);
+        for (q = 0; q < G_N_ELEMENTS(quantiles) && count; ++q)
+            g_string_append_printf(out, "pidgin_tts_stage_seconds{stage=\"%s\",quantile=\"%g\"} %g\n",
+                    stage_names[stage], quantiles[q], metrics_quantile(bucket, count, quantiles[q]) / 1e6);
+        g_string_append_printf(out,
+                "pidgin_tts_stage_seconds_sum{stage=\"%s\"} %g\n"
+                "pidgin_tts_stage_seconds_count{stage=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                stage_names[stage], sum / 1e6,
+                stage_names[stage], count);
+    }
+}
+
+/* server thread {{{2 */
+static void metrics_client(int fd)
+{
+    struct timeval timeout = { METRICS_TIMEOUT / 1000, METRICS_TIMEOUT % 1000 * 1000 };
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    gchar request[METRICS_REQUEST_MAX];
+    GString *out = g_string_new(NULL);
+    gsize len = 0, sent = 0;
+    gboolean json, http;
+    ssize_t n;
+
+    // the request is a single line, an agent that sends nothing gets Prometheus text
+    while (len < sizeof(request) - 1 && !memchr(request, '\n', len)
+            && poll(&pfd, 1, METRICS_TIMEOUT) > 0
+            && (n = read(fd, request + len, sizeof(request) - 1 - len)) > 0)
+        len += n;
+    request[len] = 0;
+
+    http = strncmp(request, "GET ", 4) == 0;
+    json = http ? strncmp(request + 4, "/json", 5) == 0 : strncmp(request, "json", 4) == 0;
+
+    if (json)
+        metrics_json(out);
+    else
+        metrics_prometheus(out);
+    if (http) {
+        gchar *header = g_strdup_printf(
+                "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %" G_GSIZE_FORMAT "\r\n\r\n",
+                json ? "application/json" : "text/plain; version=0.0.4",
+                out->len);
+        g_string_prepend(out, header);
+        g_free(header);
+    }
+
+    // a client that does not read must not keep the plugin from stopping
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    while (sent < out->len && (n = send(fd, out->str + sent, out->len - sent, MSG_NOSIGNAL)) > 0)
+        sent += n;
+    g_string_free(out, TRUE);
+}
+
+static gpointer metrics_serve(gpointer data)
+{
+    struct metrics_server *server = data;
+    struct pollfd fds[2] = {
+        { server->listen_fd, POLLIN, 0 },
+        { server->wake_fd, POLLIN, 0 },
+    };
+    int fd;
+
+    while (!g_atomic_int_get(&server->stopping)) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents || (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)))
+            break;
+        if ((fds[0].revents & POLLIN) && (fd = accept(server->listen_fd, NULL, NULL)) >= 0) {
+            metrics_client(fd);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+/* starting and stopping {{{2 */
+static void metrics_stop(void)
+{
+    struct metrics_server *server = ptts_metrics_server;
+    guint64 one = 1;
+
+    if (server == NULL)
+        return;
+
+    // the thread uses the server until it is joined. If the eventfd cannot
+    // be written, shutting down the socket wakes it as well.
+    g_atomic_int_set(&server->stopping, 1);
+    if (write(server->wake_fd, &one, sizeof(one)) != sizeof(one))
+        shutdown(server->listen_fd, SHUT_RDWR);
+    g_thread_join(server->thread);
+    close(server->listen_fd);
+    close(server->wake_fd);
+    unlink(server->path);
+    g_free(server->path);
+    g_free(server);
+    ptts_metrics_server = NULL;
+}
+
+// only a socket nobody listens on refuses the connection
+static gboolean metrics_stale(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    gboolean stale;
+
+    if (fd < 0)
+        return FALSE;
+    stale = connect(fd, (const struct sockaddr*) addr, sizeof(*addr)) < 0 && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+static gboolean metrics_start(const gchar *path)
+{
+    struct metrics_server *server;
+    struct sockaddr_un addr;
+    struct stat st;
+    GError *error = NULL;
+
+    metrics_stop();
+    if (path == NULL || *path == 0)
+        return TRUE;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        purple_debug_error(PLUGIN_NAME, "Metrics socket path is too long: %s\n", path);
+        return FALSE;
+    }
+    g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+    // a stale socket is replaced, anything else is left alone
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            purple_debug_error(PLUGIN_NAME, "Cannot serve metrics on %s: not a socket\n", path);
+            return FALSE;
+        }
+        if (!metrics_stale(&addr)) {
+            purple_debug_error(PLUGIN_NAME, "Cannot serve metrics on %s: in use\n", path);
+            return FALSE;
+        }
+        unlink(path);
+    }
+
+    server = g_new0(struct metrics_server, 1);
+    server->path = g_strdup(path);
+    server->wake_fd = eventfd(0, EFD_CLOEXEC);
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (server->wake_fd < 0 || server->listen_fd < 0
+            || bind(server->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+            || listen(server->listen_fd, METRICS_BACKLOG) < 0
+            || (server->thread = g_thread_try_new(PLUGIN_NAME " metrics", metrics_serve, server, &error)) == NULL) {
+        purple_debug_error(PLUGIN_NAME, "Cannot serve metrics on %s: '%s'\n",
+                path, error ? error->message : strerror(errno));
+        g_clear_error(&error);
+        if (server->listen_fd >= 0)
+            close(server->listen_fd);
+        if (server->wake_fd >= 0)
+            close(server->wake_fd);
+        g_free(server->path);
+        g_free(server);
+        return FALSE;
+    }
+
+    ptts_metrics_server = server;
+    return TRUE;
+}
+
+
 // Preferences {{{1
 // helpers {{{2
 # define TYPE_bool()          gboolean
+# define TYPE_int()           int
 # define TYPE_string_list()   GList*
 # define TYPE_string()        const char*
 
+// names are formatted on the stack, unless a long profile or buddy name
+// does not fit
+static gchar* pp_name(gchar *buffer, const gchar *format, va_list ap)
+{
+    va_list copy;
+    gint len;
+
+    va_copy(copy, ap);
+    len = g_vsnprintf(buffer, PREFS_PATH_MAX, format, copy);
+    va_end(copy);
+    return len >= 0 && len < PREFS_PATH_MAX ? buffer : g_strdup_vprintf(format, ap);
+}
+
 # define PP_PRINTF_W(TYPE, ACTION) \
     static void pp_##ACTION##_##TYPE(TYPE_##TYPE() value, const gchar* format, ...) __attribute__((format(printf,2,3))); \
     static void pp_##ACTION##_##TYPE(TYPE_##TYPE() value, const gchar* format, ...) \
     { \
         va_list ap; \
-        gchar *name; \
+        gchar buffer[PREFS_PATH_MAX], *name; \
         va_start(ap, format); \
-        name = g_strdup_vprintf(format, ap); \
+        name = pp_name(buffer, format, ap); \
         va_end(ap); \
         purple_prefs_##ACTION##_##TYPE(name, value); \
-        g_free(name); \
+        if (name != buffer) \
+            g_free(name); \
     } \
 
 # define PP_PRINTF(TYPE) \
@@ -319,13 +1153,14 @@ gchar* detect_language()
     static TYPE_##TYPE() pp_get_##TYPE(const gchar* format, ...) \
     { \
         va_list ap; \
-        gchar *name; \
+        gchar buffer[PREFS_PATH_MAX], *name; \
         TYPE_##TYPE() value; \
         va_start(ap, format); \
-        name = g_strdup_vprintf(format, ap); \
+        name = pp_name(buffer, format, ap); \
         va_end(ap); \
         value = purple_prefs_get_##TYPE(name); \
-        g_free(name); \
+        if (name != buffer) \
+            g_free(name); \
         return value; \
     } \
     PP_PRINTF_W(TYPE, set) \
@@ -372,6 +1207,11 @@ PP_PP(string_list);
 
 PP_ITEM(purple_prefs, active,   PREFS_ACTIVE,   bool);
 PP_ITEM(purple_prefs, shell,    PREFS_SHELL,    string);
+PP_ITEM(purple_prefs, idle_timeout, PREFS_IDLE, int);
+PP_ITEM(purple_prefs, prewarm,  PREFS_PREWARM,  bool);
+PP_ITEM(purple_prefs, focus,    PREFS_FOCUS,    bool);
+PP_ITEM(purple_prefs, activity, PREFS_ACTIVITY, int);
+PP_ITEM(purple_prefs, metrics,  PREFS_METRICS,  string);
 
 PP_ITEM(ppp, command,           PREFS_COMMAND,  string);
 PP_ITEM(ppp, compose,           PREFS_COMPOSE,  string);
@@ -379,9 +1219,57 @@ PP_ITEM(ppp, language,          PREFS_LANGUAGE, string);
 PP_ITEM(ppp, volume,            PREFS_VOLUME,   string);
 
 PP_ITEM(ppp, keywords_active,   PREFS_KEYS_ON,  bool);
+PP_ITEM(ppp, keywords_interrupt, PREFS_KEYS_INT, bool);
+PP_ITEM(ppp, announce,          PREFS_ANNOUNCE, bool);
 PP_ITEM(ppp, keywords,          PREFS_KEYWORDS, string_list);
 
 PP_ITEM(ppp, replacement,       PREFS_REPLACE,  string_list);
+PP_ITEM(ppp, regex_table,       PREFS_REGEX,    string_list);
+PP_ITEM(ppp, dictionary,        PREFS_DICT,     string);
+PP_ITEM(ppp, backend,           PREFS_BACKEND,  string);
+PP_ITEM(ppp, socket,            PREFS_SOCKET,   string);
+PP_ITEM(ppp, condense_urls,     PREFS_CONDENSE_URLS,  bool);
+PP_ITEM(ppp, condense_code,     PREFS_CONDENSE_CODE,  bool);
+PP_ITEM(ppp, condense_emoji,    PREFS_CONDENSE_EMOJI, bool);
+
+/* profiles {{{2 */
+// add a profile with the espeak defaults, existing settings are kept
+static void profile_init(const gchar *name, const gchar *backend)
+{
+    char* str = g_strdup_printf(PREFS_PROFILES, name);
+    purple_prefs_add_none(str);
+    g_free(str);
+
+    pp_add_string(PROFILE_ESPEAK_COMMAND, PREFS_COMMAND, name);
+    pp_add_string(PROFILE_ESPEAK_COMPOSE, PREFS_COMPOSE, name);
+
+    gchar* language = detect_language();
+    pp_add_string(language, PREFS_LANGUAGE, name);
+    free(language);
+
+    pp_add_string(PROFILE_ESPEAK_VOLUME, PREFS_VOLUME, name);
+
+    pp_add_string_list(PROFILE_ESPEAK_REPLACE, PREFS_REPLACE, name);
+    pp_add_string_list(PROFILE_ESPEAK_REGEX, PREFS_REGEX, name);
+    pp_add_string_list(PROFILE_ESPEAK_KEYWORDS, PREFS_KEYWORDS, name);
+    pp_add_bool(PROFILE_ESPEAK_KEYS_ON, PREFS_KEYS_ON, name);
+    pp_add_bool(PROFILE_ESPEAK_KEYS_INT, PREFS_KEYS_INT, name);
+    pp_add_bool(PROFILE_ESPEAK_ANNOUNCE, PREFS_ANNOUNCE, name);
+    pp_add_string(PROFILE_ESPEAK_DICT, PREFS_DICT, name);
+    pp_add_string(backend, PREFS_BACKEND, name);
+    pp_add_string(PROFILE_ESPEAK_SOCKET, PREFS_SOCKET, name);
+    pp_add_bool(PROFILE_ESPEAK_CONDENSE, PREFS_CONDENSE_URLS, name);
+    pp_add_bool(PROFILE_ESPEAK_CONDENSE, PREFS_CONDENSE_CODE, name);
+    pp_add_bool(PROFILE_ESPEAK_CONDENSE, PREFS_CONDENSE_EMOJI, name);
+}
+
+static gboolean profile_exists(const gchar *name)
+{
+    char* str = g_strdup_printf(PREFS_PROFILES, name);
+    gboolean exists = purple_prefs_exists(str);
+    g_free(str);
+    return exists;
+}
 
 /* logging {{{2 */
 static void pref_log_active(PurpleConversation *conv)
@@ -400,6 +1288,58 @@ static void pref_log_shell(PurpleConversation *conv)
             pref_get_shell());
 }
 
+static void pref_log_focus(PurpleConversation *conv)
+{
+    systemlog(conv,
+            "%s messages in the focused conversation are: %s",
+            PLUGIN_NAME,
+            pref_get_focus() ? "not spoken" : "spoken");
+}
+
+static void pref_log_activity(PurpleConversation *conv)
+{
+    if (pref_get_activity() > 0)
+        systemlog(conv,
+                "%s messages are not spoken for %d seconds after you sent one",
+                PLUGIN_NAME,
+                pref_get_activity());
+    else
+        systemlog(conv,
+                "%s messages are spoken while you are active",
+                PLUGIN_NAME);
+}
+
+static void pref_log_metrics(PurpleConversation *conv)
+{
+    if (ptts_metrics_server != NULL)
+        systemlog(conv,
+                "%s metrics are served on: %s",
+                PLUGIN_NAME,
+                ptts_metrics_server->path);
+    else if (*pref_get_metrics())
+        systemlog(conv,
+                "%s metrics cannot be served on: %s",
+                PLUGIN_NAME,
+                pref_get_metrics());
+    else
+        systemlog(conv,
+                "%s metrics are not served",
+                PLUGIN_NAME);
+}
+
+static void pref_log_idle_timeout(PurpleConversation *conv)
+{
+    if (pref_get_idle_timeout() > 0)
+        systemlog(conv,
+                "%s shell is stopped after %d seconds without messages",
+                PLUGIN_NAME,
+                pref_get_idle_timeout());
+    else
+        systemlog(conv,
+                "%s shell is never stopped",
+                PLUGIN_NAME);
+}
+
 static void pref_log_profile(PurpleConversation *conv)
 {
     systemlog(conv,
@@ -440,6 +1380,23 @@ static void pref_log_volume(PurpleConversation *conv)
             pref_get_volume());
 }
 
+static void pref_log_backend(PurpleConversation *conv)
+{
+    systemlog(conv,
+            "%s backend is: %s",
+            PLUGIN_NAME,
+            pref_get_backend());
+}
+
+static void pref_log_socket(PurpleConversation *conv)
+{
+    const gchar *socket = pref_get_socket();
+    systemlog(conv,
+            "%s socket is: %s",
+            PLUGIN_NAME,
+            socket && *socket ? socket : "speech-dispatcher default");
+}
+
 static void pref_log_keywords_active(PurpleConversation *conv)
 {
     systemlog(conv,
@@ -448,9 +1405,35 @@ static void pref_log_keywords_active(PurpleConversation *conv)
             pref_get_keywords_active() ? "enabled" : "disabled");
 }
 
-
-// Keyword management {{{1
-static void pref_delete_keyword(const gchar* keyword)
+static void pref_log_announce(PurpleConversation *conv)
+{
+    systemlog(conv,
+            "%s sender announcements are: %s",
+            PLUGIN_NAME,
+            pref_get_announce() ? "enabled" : "disabled");
+}
+
+static void pref_log_condense(PurpleConversation *conv)
+{
+    systemlog(conv,
+            "%s condenses urls: %s, code: %s, emoji: %s",
+            PLUGIN_NAME,
+            pref_get_condense_urls() ? "on" : "off",
+            pref_get_condense_code() ? "on" : "off",
+            pref_get_condense_emoji() ? "on" : "off");
+}
+
+static void pref_log_keywords_interrupt(PurpleConversation *conv)
+{
+    systemlog(conv,
+            "%s keywords %s the current message",
+            PLUGIN_NAME,
+            pref_get_keywords_interrupt() ? "interrupt" : "do not interrupt");
+}
+
+
+// Keyword management {{{1
+static void pref_delete_keyword(const gchar* keyword)
 {
     GList *table = pref_get_keywords(),
           *match = list_find(table, keyword, 1);
@@ -471,6 +1454,63 @@ static void pref_add_keyword(const gchar* keyword)
     }
 }
 
+/* bulk import/export {{{2 */
+struct table_import {
+    GHashTable *index;      // pattern => link in table
+    GQueue added;
+    guint count;
+};
+
+static void import_keyword(gchar **fields, gpointer data)
+{
+    struct table_import *import = data;
+
+    if (!*fields[0] || g_hash_table_contains(import->index, fields[0]))
+        return;
+
+    g_queue_push_tail(&import->added, g_strdup(fields[0]));
+    g_hash_table_insert(import->index, import->added.tail->data, import->added.tail);
+    import->count++;
+}
+
+static gboolean pref_import_keywords(const gchar *filename, guint *count)
+{
+    struct table_import import = { NULL, G_QUEUE_INIT, 0 };
+    GList *table = pref_get_keywords(), *link;
+    gboolean success;
+
+    import.index = g_hash_table_new(g_str_hash, g_str_equal);
+    for (link = table; link; link = g_list_next(link))
+        g_hash_table_insert(import.index, link->data, link);
+
+    success = tsv_read(filename, 1, import_keyword, &import);
+    table = g_list_concat(import.added.head, table);
+    if (success && import.count)
+        pref_set_keywords(table);
+
+    g_hash_table_destroy(import.index);
+    g_list_free_full(table, g_free);
+    *count = import.count;
+    return success;
+}
+
+static gboolean pref_export_keywords(const gchar *filename)
+{
+    GList *table = pref_get_keywords(), *link;
+    FILE *file = open_path(filename, "w");
+
+    if (file != NULL) {
+        for (link = table; link; link = g_list_next(link)) {
+            tsv_write_field(file, link->data);
+            fputc('\n', file);
+        }
+        fclose(file);
+    }
+
+    g_list_free_full(table, g_free);
+    return file != NULL;
+}
+
 static void pref_log_keywords(PurpleConversation *conv)
 {
     gchar *tmp, *str;
@@ -493,27 +1533,100 @@ static void pref_log_keywords(PurpleConversation *conv)
 }
 
 // Replacement table {{{1
-static void pref_delete_replace(const gchar* pattern)
+static GList* table_delete_replace(GList* table, const gchar* pattern, gboolean *found)
 {
-    GList *table = pref_get_replacement(),
-          *match = list_find(table, pattern, 2);
+    GList *match = list_find(table, pattern, 2);
+    *found = match != NULL;
     if (match != NULL) {
         g_free(g_list_nth_data(match, 1));
         g_free(g_list_nth_data(match, 0));
         table = g_list_delete_link(table, g_list_nth(match, 1));
         table = g_list_delete_link(table, g_list_nth(match, 0));
-        pref_set_replacement(table);
     }
+    return table;
+}
+
+static void pref_delete_replace(const gchar* pattern)
+{
+    gboolean found;
+    GList *table = table_delete_replace(pref_get_replacement(), pattern, &found);
+    if (found)
+        pref_set_replacement(table);
+    g_list_free_full(table, g_free);
 }
 
 static void pref_add_replace(const gchar* pattern, const gchar* replace)
 {
-    GList *table;
-    pref_delete_replace(pattern);
-    table = pref_get_replacement();
+    gboolean found;
+    GList *table = table_delete_replace(pref_get_replacement(), pattern, &found);
     table = g_list_prepend(table, g_strdup(replace));
     table = g_list_prepend(table, g_strdup(pattern));
     pref_set_replacement(table);
+    g_list_free_full(table, g_free);
+}
+
+/* bulk import/export {{{2 */
+static void import_replace(gchar **fields, gpointer data)
+{
+    struct table_import *import = data;
+    GList *match;
+
+    if (!*fields[0])
+        return;
+
+    // later lines override earlier ones and existing entries
+    match = g_hash_table_lookup(import->index, fields[0]);
+    if (match != NULL) {
+        g_free(match->next->data);
+        match->next->data = g_strdup(fields[1]);
+    }
+    else {
+        g_queue_push_tail(&import->added, g_strdup(fields[0]));
+        g_hash_table_insert(import->index, import->added.tail->data, import->added.tail);
+        g_queue_push_tail(&import->added, g_strdup(fields[1]));
+    }
+    import->count++;
+}
+
+static gboolean pref_import_replace(const gchar *filename, guint *count)
+{
+    struct table_import import = { NULL, G_QUEUE_INIT, 0 };
+    GList *table = pref_get_replacement(), *link;
+    gboolean success;
+
+    import.index = g_hash_table_new(g_str_hash, g_str_equal);
+    for (link = table; link && link->next; link = link->next->next)
+        g_hash_table_insert(import.index, link->data, link);
+
+    // new patterns go in front, just like with pref_add_replace
+    success = tsv_read(filename, 2, import_replace, &import);
+    table = g_list_concat(import.added.head, table);
+    if (success && import.count)
+        pref_set_replacement(table);
+
+    g_hash_table_destroy(import.index);
+    g_list_free_full(table, g_free);
+    *count = import.count;
+    return success;
+}
+
+static gboolean pref_export_replace(const gchar *filename)
+{
+    GList *table = pref_get_replacement(), *link;
+    FILE *file = open_path(filename, "w");
+
+    if (file != NULL) {
+        for (link = table; link && link->next; link = link->next->next) {
+            tsv_write_field(file, link->data);
+            fputc('\t', file);
+            tsv_write_field(file, link->next->data);
+            fputc('\n', file);
+        }
+        fclose(file);
+    }
+
+    g_list_free_full(table, g_free);
+    return file != NULL;
 }
 
 static void pref_log_replace(PurpleConversation *conv)
@@ -531,6 +1644,718 @@ static void pref_log_replace(PurpleConversation *conv)
     g_free(str);
 }
 
+// Regular expression rules {{{1
+// Rules are stored as pattern, replacement pairs like the replacement
+// table. A profile compiles all of them into one alternation, so a message
+// is scanned once no matter how many rules there are; every rule is a
+// capture group of its own, which tells which rule matched. The compiled
+// rules are kept until the rules themselves change.
+struct regex_rule {
+    const gchar *pattern;       // points into the table
+    gchar *replacement;         // references renumbered for the alternation
+    gint group;                 // capture group of the whole rule
+    guint64 matches;
+};
+
+// a rule that is not applied, and why
+struct regex_skip {
+    const gchar *pattern;       // points into the table
+    gchar *reason;
+};
+
+struct regex_rules {
+    GList *table;
+    GRegex *regex;              // NULL if no rule is valid
+    struct regex_rule *rules;
+    guint count;
+    GList *skipped;             // struct regex_skip
+};
+
+static gchar* regex_renumber_pattern(const gchar *pattern, gint group, gint count, gchar **error);
+
+/* editing {{{2 */
+static gboolean pref_add_regex(const gchar* pattern, const gchar* replace, gchar **error)
+{
+    GError *err = NULL;
+    GRegex *regex = g_regex_new(pattern, 0, 0, &err);
+    GList *table;
+    gboolean found;
+
+    gchar *renumbered;
+
+    if (regex == NULL) {
+        *error = g_strdup(err->message);
+        g_error_free(err);
+        return FALSE;
+    }
+    renumbered = regex_renumber_pattern(pattern, 0, g_regex_get_capture_count(regex), error);
+    g_regex_unref(regex);
+    if (renumbered == NULL)
+        return FALSE;
+    g_free(renumbered);
+
+    // rules are tried in the order they were added
+    table = table_delete_replace(pref_get_regex_table(), pattern, &found);
+    table = g_list_append(table, g_strdup(pattern));
+    table = g_list_append(table, g_strdup(replace));
+    pref_set_regex_table(table);
+    g_list_free_full(table, g_free);
+    return TRUE;
+}
+
+static gboolean pref_delete_regex(const gchar* pattern)
+{
+    gboolean found;
+    GList *table = table_delete_replace(pref_get_regex_table(), pattern, &found);
+    if (found)
+        pref_set_regex_table(table);
+    g_list_free_full(table, g_free);
+    return found;
+}
+
+/* compiling {{{2 */
+// \N, \g<N> and \0 in a replacement refer to the groups of its own rule
+static gchar* regex_renumber(const gchar *replacement, gint group)
+{
+    GString *out = g_string_new(NULL);
+    const gchar *p;
+    gchar *end;
+    gulong n;
+
+    for (p = replacement; *p; ++p) {
+        if (p[0] != '\\' || p[1] == 0) {
+            g_string_append_c(out, *p);
+            continue;
+        }
+        if (g_ascii_isdigit(p[1])) {
+            n = strtoul(p + 1, &end, 10);
+            g_string_append_printf(out, "\\g<%lu>", group + n);
+            p = end - 1;
+        }
+        else if (p[1] == 'g' && p[2] == '<' && g_ascii_isdigit(p[3])
+                && (n = strtoul(p + 3, &end, 10), *end == '>')) {
+            g_string_append_printf(out, "\\g<%lu>", group + n);
+            p = end;
+        }
+        else {
+            g_string_append_len(out, p, 2);
+            ++p;
+        }
+    }
+    return g_string_free(out, FALSE);
+}
+
+// the same for references inside the pattern, e.g. \1, \g{1} or (?1).
+// Named groups and recursion into the whole pattern would reach into the
+// other rules, so they are refused.
+static gchar* regex_renumber_pattern(const gchar *pattern, gint group, gint count, gchar **error)
+{
+    GString *out = g_string_new(NULL);
+    const gchar *p, *end, *refused = NULL;
+    gchar *number;
+    gboolean in_class = FALSE;
+    gchar close;
+    gulong n;
+
+    for (p = pattern; *p && refused == NULL; ++p) {
+        // literal text
+        if (p[0] == '\\' && p[1] == 'Q') {
+            end = strstr(p + 2, "\\E");
+            end = end ? end + 1 : p + strlen(p) - 1;
+            g_string_append_len(out, p, end - p + 1);
+            p = end;
+        }
+        else if (p[0] == '\\' && p[1] == 0)
+            g_string_append_c(out, *p);
+
+        // inside a character class there are no references
+        else if (p[0] == '\\' && in_class) {
+            g_string_append_len(out, p, 2);
+            ++p;
+        }
+        else if (in_class && p[0] == '[' && p[1] == ':' && (end = strstr(p + 2, ":]")) != NULL) {
+            g_string_append_len(out, p, end - p + 2);
+            p = end + 1;
+        }
+        else if (in_class) {
+            in_class = *p != ']';
+            g_string_append_c(out, *p);
+        }
+        else if (p[0] == '[') {
+            in_class = TRUE;
+            end = p + 1 + (p[1] == '^');
+            end += *end == ']';         // a leading ] is literal
+            g_string_append_len(out, p, end - p);
+            p = end - 1;
+        }
+
+        // \N is a reference if there are that many groups or N < 10
+        else if (p[0] == '\\' && p[1] >= '1' && p[1] <= '9'
+                && ((n = strtoul(p + 1, &number, 10)) < 10 || n <= (gulong) count)) {
+            g_string_append_printf(out, "\\g{%lu}", group + n);
+            p = number - 1;
+        }
+        // otherwise it is an octal escape
+        else if (p[0] == '\\' && p[1] >= '0' && p[1] <= '7') {
+            for (n = 0, end = p + 1; end < p + 4 && *end >= '0' && *end <= '7'; ++end)
+                n = 8*n + (*end - '0');
+            g_string_append_printf(out, "\\x{%lx}", n);
+            p = end - 1;
+        }
+
+        // \gN, \g{N}, \g<N> and \g'N', relative ones are left alone
+        else if (p[0] == '\\' && p[1] == 'g') {
+            end = p + 2;
+            close = *end == '{' ? '}' : *end == '<' ? '>' : *end == '\'' ? '\'' : 0;
+            if (close)
+                ++end;
+            if (*end == '-' || *end == '+') {
+                g_string_append_len(out, p, 2);
+                ++p;
+            }
+            else if (!g_ascii_isdigit(*end))
+                refused = "named references";
+            else if ((n = strtoul(end, &number, 10)) == 0 || (close && *number != close))
+                refused = "recursion into the whole pattern";
+            else {
+                g_string_append_len(out, p, end - p);
+                g_string_append_printf(out, "%lu", group + n);
+                p = number - 1;
+            }
+        }
+        else if (p[0] == '\\' && p[1] == 'k')
+            refused = "named references";
+        else if (p[0] == '\\') {
+            g_string_append_len(out, p, 2);
+            ++p;
+        }
+
+        // (?N) calls group N, (?R) and (?0) the whole pattern
+        else if (p[0] == '(' && p[1] == '?') {
+            if (p[2] == 'R' || (p[2] == '0' && p[3] == ')'))
+                refused = "recursion into the whole pattern";
+            else if (p[2] == '&' || p[2] == '\'' || p[2] == 'P'
+                    || (p[2] == '<' && p[3] != '=' && p[3] != '!'))
+                refused = "named groups";
+            else if (g_ascii_isdigit(p[2])) {
+                n = strtoul(p + 2, &number, 10);
+                g_string_append_printf(out, "(?%lu", group + n);
+                p = number - 1;
+            }
+            else
+                g_string_append_c(out, *p);
+        }
+        else
+            g_string_append_c(out, *p);
+    }
+
+    if (refused != NULL) {
+        *error = g_strdup_printf("%s cannot be used in regex rules", refused);
+        g_string_free(out, TRUE);
+        return NULL;
+    }
+    return g_string_free(out, FALSE);
+}
+
+static void regex_clear(struct regex_rules *rules)
+{
+    struct regex_skip *skip;
+    guint i;
+
+    for (i = 0; i < rules->count; ++i)
+        g_free(rules->rules[i].replacement);
+    while (rules->skipped != NULL) {
+        skip = rules->skipped->data;
+        g_free(skip->reason);
+        g_free(skip);
+        rules->skipped = g_list_delete_link(rules->skipped, rules->skipped);
+    }
+    if (rules->regex != NULL)
+        g_regex_unref(rules->regex);
+    rules->regex = NULL;
+    rules->count = 0;
+}
+
+static void regex_free(struct regex_rules *rules)
+{
+    if (rules == NULL)
+        return;
+    regex_clear(rules);
+    g_free(rules->rules);
+    g_list_free_full(rules->table, g_free);
+    g_free(rules);
+}
+
+static gboolean regex_same_table(GList *a, GList *b)
+{
+    for ( ; a && b; a = a->next, b = b->next)
+        if (!purple_strequal(a->data, b->data))
+            return FALSE;
+    return a == NULL && b == NULL;
+}
+
+static void regex_skip(struct regex_rules *rules, const gchar *pattern, const gchar *reason)
+{
+    struct regex_skip *skip = g_new(struct regex_skip, 1);
+
+    purple_debug_error(PLUGIN_NAME, "skipping regex %s: %s\n", pattern, reason);
+    skip->pattern = pattern;
+    skip->reason = g_strdup(reason);
+    rules->skipped = g_list_append(rules->skipped, skip);
+}
+
+// all valid rules in one alternation. With check, every rule is tried
+// against the ones before it, so a rule that breaks the combination is
+// skipped instead of taking all others down.
+static void regex_combine(struct regex_rules *rules, const struct regex_rules *old, gboolean check)
+{
+    GString *pattern = g_string_new(NULL);
+    GError *err = NULL;
+    GRegex *regex;
+    GList *link;
+    gchar *renumbered, *error = NULL;
+    gint group = 1, count;
+    gsize len;
+    guint i;
+
+    for (link = rules->table; link && link->next; link = link->next->next) {
+        regex = g_regex_new(link->data, 0, 0, &err);
+        if (regex == NULL) {
+            regex_skip(rules, link->data, err->message);
+            g_clear_error(&err);
+            continue;
+        }
+        count = g_regex_get_capture_count(regex);
+        g_regex_unref(regex);
+
+        renumbered = regex_renumber_pattern(link->data, group, count, &error);
+        if (renumbered == NULL) {
+            regex_skip(rules, link->data, error);
+            g_free(error);
+            error = NULL;
+            continue;
+        }
+
+        len = pattern->len;
+        g_string_append_printf(pattern, "%s(%s)", len ? "|" : "", renumbered);
+        g_free(renumbered);
+        if (check) {
+            regex = g_regex_new(pattern->str, 0, 0, &err);
+            if (regex == NULL) {
+                regex_skip(rules, link->data, err->message);
+                g_clear_error(&err);
+                g_string_truncate(pattern, len);
+                continue;
+            }
+            g_regex_unref(regex);
+        }
+
+        struct regex_rule *rule = &rules->rules[rules->count++];
+        rule->pattern = link->data;
+        rule->replacement = regex_renumber(link->next->data, group);
+        rule->group = group;
+        rule->matches = 0;
+        for (i = 0; old != NULL && i < old->count; ++i)
+            if (purple_strequal(old->rules[i].pattern, rule->pattern))
+                rule->matches = old->rules[i].matches;
+        group += 1 + count;
+    }
+
+    if (rules->count > 0) {
+        rules->regex = g_regex_new(pattern->str, G_REGEX_OPTIMIZE, 0, &err);
+        if (rules->regex == NULL) {
+            purple_debug_error(PLUGIN_NAME, "failed to combine regex rules: %s\n", err->message);
+            g_clear_error(&err);
+        }
+    }
+    g_string_free(pattern, TRUE);
+}
+
+// takes the table, match counts of rules that stay are kept from old
+static struct regex_rules* regex_compile(GList *table, const struct regex_rules *old)
+{
+    struct regex_rules *rules = g_new0(struct regex_rules, 1);
+
+    rules->table = table;
+    rules->rules = g_new0(struct regex_rule, g_list_length(table) / 2 + 1);
+
+    regex_combine(rules, old, FALSE);
+    if (rules->regex == NULL && rules->count > 0) {
+        regex_clear(rules);
+        regex_combine(rules, old, TRUE);
+    }
+    return rules;
+}
+
+static const gchar* regex_skipped(const struct regex_rules *rules, const gchar *pattern)
+{
+    GList *link;
+
+    for (link = rules ? rules->skipped : NULL; link; link = link->next)
+        if (purple_strequal(((struct regex_skip*) link->data)->pattern, pattern))
+            return ((struct regex_skip*) link->data)->reason;
+    return NULL;
+}
+
+/* matching {{{2 */
+// GLib allocates the match and every expanded replacement on the heap
+static gchar* regex_apply(struct arena *arena, struct regex_rules *rules, const gchar *text)
+{
+    GMatchInfo *info;
+    struct arena_string out;
+    const gchar *p = text;
+    gchar *expanded;
+    gint start, end, s, e;
+    guint i;
+
+    arena_string_init(&out, arena, strlen(text));
+    g_regex_match(rules->regex, text, 0, &info);
+    while (g_match_info_matches(info)) {
+        g_match_info_fetch_pos(info, 0, &start, &end);
+        arena_string_append_len(&out, p, text + start - p);
+        p = text + end;
+
+        // the rule whose group took part in the match
+        for (i = 0; i < rules->count; ++i)
+            if (g_match_info_fetch_pos(info, rules->rules[i].group, &s, &e) && s >= 0)
+                break;
+        if (i < rules->count) {
+            rules->rules[i].matches++;
+            expanded = g_match_info_expand_references(info, rules->rules[i].replacement, NULL);
+            if (expanded != NULL)
+                arena_string_append(&out, expanded);
+            g_free(expanded);
+        }
+
+        g_match_info_next(info, NULL);
+    }
+    g_match_info_free(info);
+
+    arena_string_append(&out, p);
+    return out.str;
+}
+
+/* logging {{{2 */
+static void regex_log(PurpleConversation *conv, const struct regex_rules *rules)
+{
+    GString *str = g_string_new(PLUGIN_NAME " regex replacements:");
+    guint i;
+
+    GList *link;
+    struct regex_skip *skip;
+
+    if (rules == NULL || (rules->count == 0 && rules->skipped == NULL))
+        g_string_append(str, " (none)");
+    for (i = 0; rules != NULL && i < rules->count; ++i)
+        g_string_append_printf(str, "\n%s => %s (%" G_GUINT64_FORMAT " matches)",
+                rules->rules[i].pattern,
+                (const gchar*) g_list_nth_data(list_find(rules->table, rules->rules[i].pattern, 2), 1),
+                rules->rules[i].matches);
+    for (link = rules ? rules->skipped : NULL; link; link = link->next) {
+        skip = link->data;
+        g_string_append_printf(str, "\n%s (disabled: %s)", skip->pattern, skip->reason);
+    }
+
+    systemlog(conv, "%s", str->str);
+    g_string_free(str, TRUE);
+}
+
+
+// Compiled dictionary {{{1
+// A compiled dictionary is a read-only file that gets mapped into memory,
+// so its size affects neither startup time nor heap usage. It consists of
+// a dict_header, the index of the first entry for every lead byte, the
+// entries sorted by pattern, and the string pool they point into. All
+// integers are stored as little endian.
+struct dict_header {
+    gchar magic[DICT_MAGIC_LEN];
+    guint32 version;
+    guint32 count;          // number of entries
+    guint32 pool_size;      // bytes in the string pool
+    guint32 max_length;     // longest pattern
+};
+
+struct dict_entry {
+    guint32 pattern, pattern_len;
+    guint32 replace, replace_len;
+};
+
+struct dict {
+    gchar *path;
+    void *map;
+    gsize size;
+    const guint32 *first;   // DICT_FANOUT+1 entries
+    const struct dict_entry *entries;
+    const guchar *pool;
+    guint32 count, pool_size;
+};
+
+/* lookup {{{2 */
+static const guchar* dict_string(const struct dict *dict, guint32 offset, guint32 len)
+{
+    if (offset > dict->pool_size || len > dict->pool_size - offset)
+        return NULL;
+    return dict->pool + offset;
+}
+
+static guint32 dict_pattern_len(const struct dict *dict, guint32 index)
+{
+    return GUINT32_FROM_LE(dict->entries[index].pattern_len);
+}
+
+// k-th byte of the pattern at index, -1 if there is none
+static gint dict_pattern_byte(const struct dict *dict, guint32 index, guint32 k)
+{
+    const struct dict_entry *entry = &dict->entries[index];
+    guint32 len = GUINT32_FROM_LE(entry->pattern_len);
+    const guchar *pattern = dict_string(dict, GUINT32_FROM_LE(entry->pattern), len);
+    return pattern && k < len ? pattern[k] : -1;
+}
+
+// find the longest pattern that is a prefix of text. Within the range of
+// candidates sharing the first k bytes with text, a pattern of length k
+// sorts first; every further byte narrows the range by binary search.
+static gboolean dict_match(const struct dict *dict, const guchar *text, gsize len, guint32 *match)
+{
+    guint32 lo, hi, a, b, mid, k;
+    gboolean found = FALSE;
+    gint c;
+
+    lo = GUINT32_FROM_LE(dict->first[text[0]]);
+    hi = MIN(GUINT32_FROM_LE(dict->first[text[0]+1]), dict->count);
+
+    for (k = 1; lo < hi; ++k) {
+        if (dict_pattern_len(dict, lo) == k) {
+            *match = lo++;
+            found = TRUE;
+        }
+        if (lo >= hi || k >= len)
+            break;
+
+        c = text[k];
+        for (a = lo, b = hi; a < b; ) {
+            mid = a + (b - a) / 2;
+            if (dict_pattern_byte(dict, mid, k) < c)
+                a = mid + 1;
+            else
+                b = mid;
+        }
+        for (lo = a, b = hi; a < b; ) {
+            mid = a + (b - a) / 2;
+            if (dict_pattern_byte(dict, mid, k) <= c)
+                a = mid + 1;
+            else
+                b = mid;
+        }
+        hi = a;
+    }
+
+    return found;
+}
+
+// replace all dictionary words in a single left-to-right pass, preferring
+// the longest match at each position
+static gchar* dict_apply(struct arena *arena, const struct dict *dict, const gchar *_text)
+{
+    const guchar *text = (const guchar*) _text, *replace;
+    gsize len = strlen(_text), i = 0;
+    struct arena_string out;
+    const struct dict_entry *entry;
+    guint32 match;
+
+    arena_string_init(&out, arena, len);
+    while (i < len) {
+        if (dict_match(dict, text + i, len - i, &match)) {
+            entry = &dict->entries[match];
+            replace = dict_string(dict,
+                    GUINT32_FROM_LE(entry->replace),
+                    GUINT32_FROM_LE(entry->replace_len));
+            if (replace != NULL)
+                arena_string_append_len(&out, (const gchar*) replace, GUINT32_FROM_LE(entry->replace_len));
+            i += GUINT32_FROM_LE(entry->pattern_len);
+        }
+        else
+            arena_string_append_c(&out, text[i++]);
+    }
+
+    return out.str;
+}
+
+/* loading {{{2 */
+static void dict_close(struct dict *dict)
+{
+    if (dict == NULL)
+        return;
+    munmap(dict->map, dict->size);
+    g_free(dict->path);
+    g_free(dict);
+}
+
+static struct dict* dict_open(const gchar *path)
+{
+    struct dict_header header;
+    struct dict *dict;
+    struct stat st;
+    gchar *expanded;
+    gsize offset;
+    void *map;
+    int fd;
+
+    if (path == NULL || *path == 0)
+        return NULL;
+
+    expanded = expand_path(path);
+    fd = open(expanded, O_RDONLY);
+    g_free(expanded);
+    if (fd < 0 || fstat(fd, &st) < 0 || (gsize) st.st_size < sizeof(header) + (DICT_FANOUT+1)*sizeof(guint32)) {
+        purple_debug_error(PLUGIN_NAME, "Cannot load dictionary %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        purple_debug_error(PLUGIN_NAME, "Cannot map dictionary %s: '%s'\n", path, strerror(errno));
+        return NULL;
+    }
+
+    // only the header is checked here, entries are bounds checked on access
+    memcpy(&header, map, sizeof(header));
+    offset = sizeof(header) + (DICT_FANOUT+1)*sizeof(guint32)
+        + (gsize) GUINT32_FROM_LE(header.count)*sizeof(struct dict_entry);
+    if (memcmp(header.magic, DICT_MAGIC, DICT_MAGIC_LEN) != 0
+            || GUINT32_FROM_LE(header.version) != DICT_VERSION
+            || offset + GUINT32_FROM_LE(header.pool_size) > (gsize) st.st_size) {
+        purple_debug_error(PLUGIN_NAME, "Invalid dictionary %s\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    dict = g_new0(struct dict, 1);
+    dict->path = g_strdup(path);
+    dict->map = map;
+    dict->size = st.st_size;
+    dict->count = GUINT32_FROM_LE(header.count);
+    dict->pool_size = GUINT32_FROM_LE(header.pool_size);
+    dict->first = (const guint32*) ((const gchar*) map + sizeof(header));
+    dict->entries = (const struct dict_entry*) (dict->first + DICT_FANOUT+1);
+    dict->pool = (const guchar*) map + offset;
+    return dict;
+}
+
+/* compiling {{{2 */
+static void dict_compile_line(gchar **fields, gpointer data)
+{
+    if (*fields[0])
+        g_hash_table_replace(data, g_strdup(fields[0]), g_strdup(fields[1]));
+}
+
+static int dict_compare(const void *a, const void *b)
+{
+    return strcmp(*(const gchar**) a, *(const gchar**) b);
+}
+
+static gboolean dict_compile(const gchar *source, const gchar *target, guint *count)
+{
+    GHashTable *table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    struct dict_header header;
+    struct dict_entry entry;
+    guint32 first[DICT_FANOUT+1], pool = 0, max_length = 0, len;
+    GList *keys, *link;
+    gchar **patterns, *replace, *expanded, *tmpname;
+    gboolean success;
+    FILE *file;
+    guint i, n, c;
+
+    if (!tsv_read(source, 2, dict_compile_line, table)) {
+        g_hash_table_destroy(table);
+        return FALSE;
+    }
+
+    n = g_hash_table_size(table);
+    patterns = g_new(gchar*, n);
+    keys = g_hash_table_get_keys(table);
+    for (i = 0, link = keys; link; link = g_list_next(link))
+        patterns[i++] = link->data;
+    g_list_free(keys);
+    qsort(patterns, n, sizeof(gchar*), dict_compare);
+
+    for (i = 0, c = 0; c <= DICT_FANOUT; ++c) {
+        while (i < n && (guchar) patterns[i][0] < c)
+            ++i;
+        first[c] = GUINT32_TO_LE(i);
+    }
+
+    // write to a temporary file first, so that mapped dictionaries stay valid
+    expanded = expand_path(target);
+    tmpname = g_strconcat(expanded, ".tmp", NULL);
+    file = fopen(tmpname, "wb");
+    success = file != NULL;
+
+    if (success) {
+        for (i = 0; i < n; ++i) {
+            len = strlen(patterns[i]);
+            max_length = MAX(max_length, len);
+            pool += len + strlen(g_hash_table_lookup(table, patterns[i]));
+        }
+
+        memcpy(header.magic, DICT_MAGIC, DICT_MAGIC_LEN);
+        header.version = GUINT32_TO_LE(DICT_VERSION);
+        header.count = GUINT32_TO_LE(n);
+        header.pool_size = GUINT32_TO_LE(pool);
+        header.max_length = GUINT32_TO_LE(max_length);
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(first, sizeof(first), 1, file);
+
+        for (i = 0, pool = 0; i < n; ++i) {
+            replace = g_hash_table_lookup(table, patterns[i]);
+            entry.pattern_len = strlen(patterns[i]);
+            entry.replace_len = strlen(replace);
+            entry.pattern = GUINT32_TO_LE(pool);
+            entry.replace = GUINT32_TO_LE(pool + entry.pattern_len);
+            pool += entry.pattern_len + entry.replace_len;
+            entry.pattern_len = GUINT32_TO_LE(entry.pattern_len);
+            entry.replace_len = GUINT32_TO_LE(entry.replace_len);
+            fwrite(&entry, sizeof(entry), 1, file);
+        }
+
+        for (i = 0; i < n; ++i) {
+            fputs(patterns[i], file);
+            fputs(g_hash_table_lookup(table, patterns[i]), file);
+        }
+
+        success = !ferror(file);
+        success = fclose(file) == 0 && success;
+        success = success && rename(tmpname, expanded) == 0;
+        if (!success) {
+            purple_debug_error(PLUGIN_NAME, "Cannot write dictionary %s: '%s'\n", target, strerror(errno));
+            unlink(tmpname);
+        }
+    }
+
+    *count = n;
+    g_free(expanded);
+    g_free(tmpname);
+    g_free(patterns);
+    g_hash_table_destroy(table);
+    return success;
+}
+
+/* logging {{{2 */
+static void dict_log(PurpleConversation *conv, const struct dict *dict)
+{
+    if (dict == NULL)
+        systemlog(conv, "%s uses no dictionary", PLUGIN_NAME);
+    else
+        systemlog(conv,
+                "%s dictionary is: %s (%u entries)",
+                PLUGIN_NAME,
+                dict->path,
+                dict->count);
+}
+
 // Conversation preferences {{{1
 /* getters {{{2 */
 static gboolean conv_get_active(PurpleConversation *conv)
@@ -543,6 +2368,11 @@ static gboolean conv_get_inactive(PurpleConversation *conv)
     return g_list_find(inactive_conversations, conv) != NULL;
 }
 
+static struct backend* conv_get_backend(PurpleConversation *conv)
+{
+    return g_hash_table_lookup(conv_backends, conv);
+}
+
 /* setters {{{2 */
 static void conv_set_active(PurpleConversation *conv, gboolean active);
 static void conv_set_inactive(PurpleConversation *conv, gboolean inactive);
@@ -567,103 +2397,2086 @@ static void conv_set_inactive(PurpleConversation *conv, gboolean inactive)
         inactive_conversations = g_list_remove(inactive_conversations, conv);
 }
 
-/* logging {{{2 */
-static void conv_log_active(PurpleConversation *conv) {
+static void conv_set_backend(PurpleConversation *conv, struct backend *backend)
+{
+    if (backend != NULL)
+        g_hash_table_replace(conv_backends, conv, backend);
+    else
+        g_hash_table_remove(conv_backends, conv);
+}
+
+static void conv_deleted(PurpleConversation *conv)
+{
+    active_conversations = g_list_remove(active_conversations, conv);
+    inactive_conversations = g_list_remove(inactive_conversations, conv);
+    g_hash_table_remove(conv_backends, conv);
+}
+
+/* logging {{{2 */
+static void conv_log_active(PurpleConversation *conv) {
     if (conv_get_active(conv) || conv_get_inactive(conv))
         systemlog(conv,
                 "%s is %s for this conversation",
                 PLUGIN_NAME,
                 conv_get_active(conv) ? "enabled" : "disabled");
     else
-        systemlog(conv,
-                "%s uses the default setting (%s) for this conversation",
-                PLUGIN_NAME,
-                pref_get_active() ? "enabled" : "disabled");
+        systemlog(conv,
+                "%s uses the default setting (%s) for this conversation",
+                PLUGIN_NAME,
+                pref_get_active() ? "enabled" : "disabled");
+}
+
+// Message trace {{{1
+// A trace file starts with TRACE_MAGIC, followed by one trace_record per
+// received message. Every record is immediately followed by the sender and
+// the raw message bytes. All integers are stored as little endian.
+struct trace_record {
+    guint64 time;           // microseconds since the epoch
+    guint32 conv;           // hash of the conversation name
+    guint32 flags;          // PurpleMessageFlags
+    guint32 sender_len;
+    guint32 message_len;
+};
+
+struct trace_replay {
+    PurpleConversation *conv;
+    gchar *data;
+    gsize size, pos;
+    gdouble speed;          // 0 replays as fast as possible
+    gint64 trace_start, wall_start;
+    gint64 busy, busy_max;  // time spent in process_message
+    guint timer, count, spoken;
+};
+
+static FILE *ptts_trace_file;
+static struct trace_replay *ptts_replay;
+
+/* recording {{{2 */
+static void trace_stop()
+{
+    if (ptts_trace_file != NULL) {
+        fclose(ptts_trace_file);
+        ptts_trace_file = NULL;
+    }
+}
+
+static gboolean trace_start(const gchar *filename)
+{
+    trace_stop();
+
+    ptts_trace_file = fopen(filename, "ab");
+    if (ptts_trace_file == NULL) {
+        purple_debug_error(PLUGIN_NAME, "Cannot open trace %s: '%s'\n", filename, strerror(errno));
+        return FALSE;
+    }
+
+    fseek(ptts_trace_file, 0, SEEK_END);
+    if (ftell(ptts_trace_file) == 0)
+        fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, ptts_trace_file);
+    return TRUE;
+}
+
+static void trace_write(PurpleConversation *conv, const gchar *who, const gchar *message, PurpleMessageFlags flags)
+{
+    struct trace_record rec;
+    // a new IM has no conversation yet, it is named after the sender
+    const gchar *name = conv ? purple_conversation_get_name(conv) : who;
+    guint32 sender_len = who ? strlen(who) : 0,
+            message_len = message ? strlen(message) : 0;
+
+    rec.time = GUINT64_TO_LE(g_get_real_time());
+    rec.conv = GUINT32_TO_LE(name ? g_str_hash(name) : 0);
+    rec.flags = GUINT32_TO_LE(flags);
+    rec.sender_len = GUINT32_TO_LE(sender_len);
+    rec.message_len = GUINT32_TO_LE(message_len);
+
+    fwrite(&rec, sizeof(rec), 1, ptts_trace_file);
+    fwrite(who, 1, sender_len, ptts_trace_file);
+    fwrite(message, 1, message_len, ptts_trace_file);
+    fflush(ptts_trace_file);
+}
+
+/* replaying {{{2 */
+static gboolean trace_peek(struct trace_replay *replay, struct trace_record *rec)
+{
+    gsize left = replay->size - replay->pos;
+
+    if (left < sizeof(*rec))
+        return FALSE;
+
+    memcpy(rec, replay->data + replay->pos, sizeof(*rec));
+    rec->time = GUINT64_FROM_LE(rec->time);
+    rec->conv = GUINT32_FROM_LE(rec->conv);
+    rec->flags = GUINT32_FROM_LE(rec->flags);
+    rec->sender_len = GUINT32_FROM_LE(rec->sender_len);
+    rec->message_len = GUINT32_FROM_LE(rec->message_len);
+
+    return left - sizeof(*rec) >= (gsize) rec->sender_len + rec->message_len;
+}
+
+static void trace_replay_stop()
+{
+    if (ptts_replay == NULL)
+        return;
+    if (ptts_replay->timer)
+        purple_timeout_remove(ptts_replay->timer);
+    g_free(ptts_replay->data);
+    g_free(ptts_replay);
+    ptts_replay = NULL;
+}
+
+static void trace_replay_finish(struct trace_replay *replay)
+{
+    gdouble elapsed = (g_get_monotonic_time() - replay->wall_start) / (gdouble) G_USEC_PER_SEC;
+
+    systemlog(replay->conv,
+            "%s - replayed %u messages (%u spoken) in %.3f s, processing took %.3f ms on average (max %.3f ms)",
+            PLUGIN_NAME,
+            replay->count,
+            replay->spoken,
+            elapsed,
+            replay->count ? replay->busy / 1000.0 / replay->count : 0.0,
+            replay->busy_max / 1000.0);
+
+    trace_replay_stop();
+}
+
+static gboolean trace_replay_step(gpointer data)
+{
+    struct trace_replay *replay = data;
+    struct trace_record rec;
+    gint64 now = g_get_monotonic_time(), due, busy;
+    guint batch = 0;
+    gchar *sender, *message;
+
+    replay->timer = 0;
+
+    while (trace_peek(replay, &rec)) {
+        if (replay->speed > 0) {
+            due = replay->wall_start + (gint64) (((gint64) rec.time - replay->trace_start) / replay->speed);
+            if (due > now) {
+                replay->timer = purple_timeout_add((due - now + 999) / 1000, trace_replay_step, replay);
+                return FALSE;
+            }
+        }
+        else if (++batch > TRACE_REPLAY_BATCH) {
+            // yield to the main loop now and then
+            replay->timer = purple_timeout_add(0, trace_replay_step, replay);
+            return FALSE;
+        }
+
+        replay->pos += sizeof(rec);
+        sender = g_strndup(replay->data + replay->pos, rec.sender_len);
+        replay->pos += rec.sender_len;
+        message = g_strndup(replay->data + replay->pos, rec.message_len);
+        replay->pos += rec.message_len;
+
+        busy = g_get_monotonic_time();
+        if (process_message(purple_conversation_get_account(replay->conv), replay->conv, sender, message, FALSE))
+            replay->spoken++;
+        busy = g_get_monotonic_time() - busy;
+
+        replay->busy += busy;
+        replay->busy_max = MAX(replay->busy_max, busy);
+        replay->count++;
+        g_free(sender);
+        g_free(message);
+    }
+
+    trace_replay_finish(replay);
+    return FALSE;
+}
+
+static gboolean trace_replay_start(PurpleConversation *conv, const gchar *filename, gdouble speed)
+{
+    struct trace_replay *replay;
+    struct trace_record rec;
+    gchar *data;
+    gsize size;
+
+    if (!g_file_get_contents(filename, &data, &size, NULL))
+        return FALSE;
+
+    if (size < TRACE_MAGIC_LEN || memcmp(data, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        g_free(data);
+        return FALSE;
+    }
+
+    trace_replay_stop();
+
+    replay = g_new0(struct trace_replay, 1);
+    replay->conv = conv;
+    replay->data = data;
+    replay->size = size;
+    replay->pos = TRACE_MAGIC_LEN;
+    replay->speed = speed;
+    replay->wall_start = g_get_monotonic_time();
+    if (trace_peek(replay, &rec))
+        replay->trace_start = rec.time;
+
+    ptts_replay = replay;
+    replay->timer = purple_timeout_add(0, trace_replay_step, replay);
+    return TRUE;
+}
+
+static void trace_conversation_deleted(PurpleConversation *conv)
+{
+    if (ptts_replay != NULL && ptts_replay->conv == conv)
+        trace_replay_stop();
+}
+
+/* output sink {{{2 */
+static void sink_set(int sink, const gchar *path)
+{
+    if (ptts_sink_null >= 0) {
+        close(ptts_sink_null);
+        ptts_sink_null = -1;
+    }
+    g_free(ptts_sink_path);
+    ptts_sink_path = g_strdup(path);
+    ptts_sink_count = 0;
+    ptts_sink = sink;
+
+    if (sink == SINK_NULL)
+        ptts_sink_null = open("/dev/null", O_WRONLY);
+}
+
+static void wav_put(guchar *p, guint32 value, int bytes)
+{
+    for ( ; bytes > 0; --bytes, value >>= 8)
+        *p++ = value & 0xff;
+}
+
+static FILE* wav_open(guint32 rate)
+{
+    guchar header[44];
+    gchar *path = g_strdup_printf("%s/%06u.wav", ptts_sink_path, ++ptts_sink_count);
+    FILE *file = fopen(path, "wb");
+
+    if (file == NULL)
+        purple_debug_error(PLUGIN_NAME, "Cannot write %s: '%s'\n", path, strerror(errno));
+    g_free(path);
+    if (file == NULL)
+        return NULL;
+
+    // 16 bit mono PCM, sizes are filled in by wav_close
+    memcpy(header, "RIFF\0\0\0\0WAVEfmt ", 16);
+    wav_put(header + 16, 16, 4);
+    wav_put(header + 20, 1, 2);
+    wav_put(header + 22, 1, 2);
+    wav_put(header + 24, rate, 4);
+    wav_put(header + 28, rate * 2, 4);
+    wav_put(header + 32, 2, 2);
+    wav_put(header + 34, 16, 2);
+    memcpy(header + 36, "data\0\0\0\0", 8);
+    fwrite(header, sizeof(header), 1, file);
+    return file;
+}
+
+static void wav_close(FILE *file, guint32 bytes)
+{
+    guchar size[4];
+
+    wav_put(size, 36 + bytes, 4);
+    fseek(file, 4, SEEK_SET);
+    fwrite(size, sizeof(size), 1, file);
+
+    wav_put(size, bytes, 4);
+    fseek(file, 40, SEEK_SET);
+    fwrite(size, sizeof(size), 1, file);
+    fclose(file);
+}
+
+static void sink_log(PurpleConversation *conv)
+{
+    if (ptts_sink == SINK_NULL)
+        systemlog(conv, "%s output is discarded", PLUGIN_NAME);
+    else if (ptts_sink == SINK_WAV)
+        systemlog(conv, "%s output is written to: %s", PLUGIN_NAME, ptts_sink_path);
+    else
+        systemlog(conv, "%s output is sent to: %s", PLUGIN_NAME, pref_get_shell());
+}
+
+// Speech backends {{{1
+// Every profile under PREFS_PROFILES becomes a backend object when it is
+// first used. It caches the compiled profile settings, so messages never
+// go through the prefs, and owns the child process that speaks for the
+// profile: either a shell reading composed command lines, the helper
+// process that synthesizes text from a shared memory ring buffer, or a
+// connection to a speech server.
+// Profiles are recompiled lazily whenever one of their prefs changes.
+//
+// Messages for the shell and the helper wait in two lanes inside the
+// plugin and are handed over one at a time, so keyword hits can overtake
+// the backlog. Speech servers keep their own queue and get a priority.
+enum priority {
+    PRIORITY_NORMAL,
+    PRIORITY_HIGH,          // keyword hit, spoken next
+    PRIORITY_INTERRUPT      // keyword hit, cuts the current normal message
+};
+
+enum lane {
+    LANE_NORMAL,
+    LANE_HIGH,
+    LANES
+};
+
+// a waiting message, and its sender if it should be announced
+struct utterance {
+    gchar *who, *name;
+    gchar *text;
+};
+
+enum backend_type {
+    BACKEND_SHELL,
+    BACKEND_HELPER,
+    BACKEND_SSIP
+};
+
+struct backend {
+    gchar *name;
+
+    // compiled profile
+    gboolean compiled;
+    enum backend_type type;
+    gchar *command, *language, *volume, *socket;
+    gchar *head, *mid, *tail;   // command line around message and extra
+    gsize head_len, mid_len, tail_len;
+    gboolean has_message, has_extra;
+    GList *replacement;
+    struct regex_rules *regex;  // survives recompiles that leave it alone
+    GList *keywords;
+    struct ptts_scan keyword_leads;     // first bytes of all keywords, both cases
+    gboolean keywords_active, keywords_interrupt;
+    gboolean announce;
+    guint condense;             // CONDENSE_* rules
+    struct dict *dict;
+
+    // waiting messages, and the one the child is speaking
+    GQueue lane[LANES];
+    gboolean busy, interrupting;
+    enum lane busy_lane;
+    guint32 busy_id;
+    gint64 busy_since;              // monotonic, for the speech latency
+
+    // the child is started on the first message that needs speech and
+    // stopped after PREFS_IDLE seconds without messages
+    int queue_stdin, queue_pid;
+    gint64 queue_used;
+    guint queue_timer;
+
+    // the shell reports on stdout when a message is done
+    int queue_stdout;
+    guint queue_watch;
+    GString *queue_output;
+    int queue_child;
+
+    // helper process, see ptts-ring.h
+    struct ptts_shm *shm;
+    int request_fd, response_fd, output_fd;
+    int input_fd;                   // the helper exits when this is closed
+    guint response_watch, output_watch;
+    guint32 next_id;
+    gboolean voice_sent;
+    gchar *voice_language, *voice_volume;   // as last sent
+    FILE *wav;
+    guint32 wav_bytes;
+
+    // speech server connection. Requests are pipelined, ssip_pending
+    // counts the replies that are still outstanding.
+    int ssip_fd;
+    guint ssip_read_watch, ssip_write_watch;
+    GString *ssip_input, *ssip_output;
+    guint ssip_pending;
+    gint64 ssip_failed;
+};
+
+static void backend_stop(struct backend *backend);
+static void backend_done(struct backend *backend);
+static void helper_warm_all(struct backend *backend);
+
+// remember the voice the child has, so that a recompile can skip it
+static void backend_voice_sent(struct backend *backend)
+{
+    g_free(backend->voice_language);
+    g_free(backend->voice_volume);
+    backend->voice_language = g_strdup(backend->language);
+    backend->voice_volume = g_strdup(backend->volume);
+    backend->voice_sent = TRUE;
+}
+
+/* shell {{{2 */
+// every message runs in a background shell of its own session, so that
+// interrupting it stops the whole pipeline. The shell prints its pid, which
+// is also the process group, and an empty line once it is finished.
+// Messages have no newlines, so they cannot end the here-document.
+# define SHELL_PREFIX   "setsid sh >/dev/null 2>&1 <<'PTTS_EOF' & echo $!; wait; echo\n"
+# define SHELL_SUFFIX   "\nPTTS_EOF\n"
+
+static void shell_interrupt(int child)
+{
+    // until setsid() ran there is no group, and no pipeline either
+    if (kill(-child, SIGTERM) < 0 && errno == ESRCH)
+        kill(child, SIGTERM);
+}
+
+static void shell_stop(struct backend *backend)
+{
+    // the shell exits after the current message
+    close(backend->queue_stdin);
+    purple_input_remove(backend->queue_watch);
+    close(backend->queue_stdout);
+    g_string_free(backend->queue_output, TRUE);
+
+    backend->queue_stdin = backend->queue_stdout = -1;
+    backend->queue_watch = 0;
+    backend->queue_output = NULL;
+    backend->queue_pid = backend->queue_child = 0;
+    purple_debug_info(PLUGIN_NAME, "stopped %s for profile %s\n", pref_get_shell(), backend->name);
+}
+
+static void shell_readable(gpointer data, gint fd, PurpleInputCondition cond)
+{
+    struct backend *backend = data;
+    GString *output = backend->queue_output;
+    gchar buffer[256], *eol;
+    ssize_t len;
+    gsize line;
+
+    len = read(fd, buffer, sizeof(buffer));
+    if (len < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (len <= 0) {
+        purple_debug_error(PLUGIN_NAME, "%s for profile %s exited\n", pref_get_shell(), backend->name);
+        backend_stop(backend);
+        return;
+    }
+
+    g_string_append_len(output, buffer, len);
+    while ((eol = memchr(output->str, '\n', output->len)) != NULL) {
+        line = eol - output->str;
+        *eol = 0;
+        if (line > 0) {
+            backend->queue_child = atoi(output->str);
+            if (backend->interrupting)
+                shell_interrupt(backend->queue_child);
+        }
+        g_string_erase(output, 0, line + 1);
+
+        if (line == 0) {
+            backend_done(backend);
+            if (backend->queue_output != output)
+                return;     // stopped
+        }
+    }
+}
+
+static gboolean shell_start(struct backend *backend)
+{
+    backend->queue_pid = spawn(pref_get_shell(), NULL, 0, &backend->queue_stdin, &backend->queue_stdout);
+    if (backend->queue_pid == 0) {
+        purple_debug_error(PLUGIN_NAME, "Cannot start %s\n", pref_get_shell());
+        backend->queue_stdin = backend->queue_stdout = -1;
+        return FALSE;
+    }
+    backend->queue_output = g_string_new(NULL);
+    backend->queue_watch = purple_input_add(backend->queue_stdout, PURPLE_INPUT_READ, shell_readable, backend);
+    purple_debug_info(PLUGIN_NAME, "started %s for profile %s\n", pref_get_shell(), backend->name);
+    return TRUE;
+}
+
+// write the composed command line for message to fd. The trailing
+// parameter is free for extra options, which is where espeak learns
+// about the WAV file.
+static gboolean shell_write(struct backend *backend, int fd, const gchar *message)
+{
+    struct iovec iov[7];
+    struct arena_mark mark = arena_mark(&ptts_arena);
+    const gchar *extra = NULL;
+    gboolean wrap = fd == backend->queue_stdin;
+    int n = 0;
+
+    if (ptts_sink == SINK_WAV)
+        extra = arena_printf(&ptts_arena, "-w '%s/%06u.wav'\n", ptts_sink_path, ++ptts_sink_count);
+
+    if (wrap) {
+        iov[n].iov_base = SHELL_PREFIX;
+        iov[n++].iov_len = strlen(SHELL_PREFIX);
+    }
+    iov[n].iov_base = backend->head;
+    iov[n++].iov_len = backend->head_len;
+    iov[n].iov_base = (gchar*) message;
+    iov[n++].iov_len = strlen(message);
+    iov[n].iov_base = backend->mid;
+    iov[n++].iov_len = backend->mid_len;
+    if (backend->has_extra) {
+        iov[n].iov_base = (gchar*) (extra ? extra : "\n");
+        iov[n].iov_len = strlen(iov[n].iov_base);
+        ++n;
+    }
+    iov[n].iov_base = backend->tail;
+    iov[n++].iov_len = backend->tail_len;
+    if (wrap) {
+        iov[n].iov_base = SHELL_SUFFIX;
+        iov[n++].iov_len = strlen(SHELL_SUFFIX);
+    }
+
+    ssize_t written = writev(fd, iov, n);
+    arena_release(&ptts_arena, mark);
+
+    if (written < 0) {
+        purple_debug_error(PLUGIN_NAME, "Error while executing %s: '%s'\n", backend->command, strerror(errno));
+        // the shell died, start a new one with the next message
+        if (wrap)
+            backend_stop(backend);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* helper process {{{2 */
+static void helper_child_setup(gpointer data)
+{
+    // glib marks all descriptors close-on-exec, except for these
+    int *fds = data, i;
+    for (i = 0; i < 3; ++i)
+        fcntl(fds[i], F_SETFD, 0);
+}
+
+// the pid stays valid until it is reaped here, not only when the backend
+// is stopped
+static void helper_reap(GPid pid, gint status, gpointer data)
+{
+    purple_debug_info(PLUGIN_NAME, "helper %d exited with status %d\n", pid, status);
+    g_spawn_close_pid(pid);
+}
+
+static void helper_stop(struct backend *backend)
+{
+    purple_input_remove(backend->response_watch);
+    purple_input_remove(backend->output_watch);
+
+    // cut the current message, the helper exits at the end of its input
+    if (backend->busy)
+        __atomic_store_n(&backend->shm->cancel, backend->busy_id, __ATOMIC_RELEASE);
+    close(backend->input_fd);
+    close(backend->request_fd);
+    close(backend->response_fd);
+    close(backend->output_fd);
+    munmap(backend->shm, backend->shm->size);
+
+    if (backend->wav != NULL)
+        wav_close(backend->wav, backend->wav_bytes);
+
+    backend->shm = NULL;
+    backend->wav = NULL;
+    backend->queue_pid = 0;
+    backend->input_fd = -1;
+    purple_debug_info(PLUGIN_NAME, "stopped helper for profile %s\n", backend->name);
+}
+
+// PCM and completion records coming back from the helper
+static void helper_response(gpointer data, gint fd, PurpleInputCondition cond)
+{
+    struct backend *backend = data;
+    struct ptts_msg msg;
+    const guchar *record;
+    guint64 count;
+    guint32 len;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+
+    while ((record = ptts_ring_peek(backend->shm, &backend->shm->response, &len)) != NULL) {
+        if (len >= sizeof(msg)) {
+            memcpy(&msg, record, sizeof(msg));
+
+            if (msg.type == PTTS_MSG_PCM && ptts_sink == SINK_WAV) {
+                if (backend->wav == NULL) {
+                    backend->wav = wav_open(msg.arg);
+                    backend->wav_bytes = 0;
+                }
+                if (backend->wav != NULL) {
+                    fwrite(record + sizeof(msg), 1, len - sizeof(msg), backend->wav);
+                    backend->wav_bytes += len - sizeof(msg);
+                }
+            }
+
+            else if (msg.type == PTTS_MSG_DONE) {
+                if (msg.arg == PTTS_DONE_CLIP_HIT)
+                    METRIC_ADD(clip_hits, 1);
+                else if (msg.arg == PTTS_DONE_CLIP_MISS)
+                    METRIC_ADD(clip_misses, 1);
+                if (backend->wav != NULL) {
+                    wav_close(backend->wav, backend->wav_bytes);
+                    backend->wav = NULL;
+                }
+                if (msg.id == backend->busy_id)
+                    backend_done(backend);
+            }
+        }
+        ptts_ring_consume(&backend->shm->response, len);
+    }
+}
+
+// the helper never writes to stdout, so this fires when it exits
+static void helper_output(gpointer data, gint fd, PurpleInputCondition cond)
+{
+    struct backend *backend = data;
+    purple_debug_error(PLUGIN_NAME, "helper for profile %s exited\n", backend->name);
+    backend_stop(backend);
+}
+
+static gboolean helper_start(struct backend *backend)
+{
+    gchar *dir, *path, *argv[5];
+    guint32 size = ptts_shm_layout(NULL, BACKEND_HELPER_REQUESTS, BACKEND_HELPER_RESPONSES);
+    int fds[3];
+    GPid pid = 0;
+    void *map;
+
+    fds[0] = memfd_create(PLUGIN_ID, MFD_CLOEXEC);
+    if (fds[0] < 0 || ftruncate(fds[0], size) < 0
+            || (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) == MAP_FAILED) {
+        purple_debug_error(PLUGIN_NAME, "Cannot create shared memory: '%s'\n", strerror(errno));
+        if (fds[0] >= 0)
+            close(fds[0]);
+        return FALSE;
+    }
+    ptts_shm_layout(map, BACKEND_HELPER_REQUESTS, BACKEND_HELPER_RESPONSES);
+
+    fds[1] = eventfd(0, EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    // the helper is installed next to the plugin
+    dir = g_path_get_dirname(ptts_instance->path);
+    path = g_build_filename(dir, BACKEND_HELPER_BINARY, NULL);
+    argv[0] = path;
+    argv[1] = g_strdup_printf("%d", fds[0]);
+    argv[2] = g_strdup_printf("%d", fds[1]);
+    argv[3] = g_strdup_printf("%d", fds[2]);
+    argv[4] = NULL;
+
+    if (fds[1] >= 0 && fds[2] >= 0)
+        g_spawn_async_with_pipes(
+                NULL,           // inherit current working directory
+                argv,           // argv
+                NULL,           // envp
+                // without a double fork pidgin is the parent, so the
+                // helper's death signal fires when pidgin goes away
+                G_SPAWN_STDERR_TO_DEV_NULL | G_SPAWN_DO_NOT_REAP_CHILD,
+                helper_child_setup,
+                fds,            // USERDATA
+                &pid,           // child PID
+                &backend->input_fd,
+                &backend->output_fd,
+                NULL,           // child's STDERR
+                NULL            // error
+            );
+
+    close(fds[0]);
+    g_free(argv[1]);
+    g_free(argv[2]);
+    g_free(argv[3]);
+    g_free(dir);
+
+    if (pid == 0) {
+        purple_debug_error(PLUGIN_NAME, "Cannot start %s\n", path);
+        g_free(path);
+        if (fds[1] >= 0)
+            close(fds[1]);
+        if (fds[2] >= 0)
+            close(fds[2]);
+        munmap(map, size);
+        return FALSE;
+    }
+
+    purple_debug_info(PLUGIN_NAME, "started %s for profile %s\n", path, backend->name);
+    g_free(path);
+
+    g_child_watch_add(pid, helper_reap, NULL);
+    backend->shm = map;
+    backend->queue_pid = pid;
+    backend->request_fd = fds[1];
+    backend->response_fd = fds[2];
+    backend->voice_sent = FALSE;
+    backend->response_watch = purple_input_add(fds[2], PURPLE_INPUT_READ, helper_response, backend);
+    backend->output_watch = purple_input_add(backend->output_fd, PURPLE_INPUT_READ, helper_output, backend);
+
+    if (backend->announce)
+        helper_warm_all(backend);
+    return TRUE;
+}
+
+static gboolean helper_push(struct backend *backend, guint32 type, guint32 flags, guint32 arg, const gchar *data, gsize len)
+{
+    struct ptts_msg msg;
+    guint64 one = 1;
+
+    msg.type = type;
+    msg.id = ++backend->next_id;
+    msg.flags = flags | (ptts_sink == SINK_WAV ? PTTS_FLAG_PCM : 0);
+    msg.arg = arg;
+
+    if (!ptts_ring_push(backend->shm, &backend->shm->request, &msg, sizeof(msg), data, len)) {
+        purple_debug_error(PLUGIN_NAME, "helper queue for profile %s is full\n", backend->name);
+        return FALSE;
+    }
+    return write(backend->request_fd, &one, sizeof(one)) == sizeof(one);
+}
+
+static void helper_voice(struct backend *backend)
+{
+    const gchar *language = backend->language ? backend->language : "";
+
+    if (!backend->voice_sent && helper_push(backend, PTTS_MSG_VOICE, 0,
+                backend->volume ? atoi(backend->volume) : 100,
+                language, strlen(language) + 1))
+        backend_voice_sent(backend);
+}
+
+// NUL separated strings, as the helper expects them
+static struct arena_string helper_strings(const gchar *first, const gchar *second, const gchar *third)
+{
+    struct arena_string data;
+
+    arena_string_init(&data, &ptts_arena, strlen(first) + 1);
+    arena_string_append_len(&data, first, strlen(first) + 1);
+    if (second != NULL)
+        arena_string_append_len(&data, second, strlen(second) + 1);
+    if (third != NULL)
+        arena_string_append_len(&data, third, strlen(third) + 1);
+    return data;
+}
+
+// also called for waiting messages once the helper is done
+static gboolean helper_speak(struct backend *backend, struct utterance *utterance)
+{
+    struct arena_mark mark = arena_mark(&ptts_arena);
+    struct arena_string data;
+    gboolean pushed;
+
+    helper_voice(backend);
+
+    // the helper puts the cached name clip in front of the message
+    if (utterance->who != NULL) {
+        data = helper_strings(utterance->who, utterance->name, utterance->text);
+        pushed = helper_push(backend, PTTS_MSG_SPEAK, PTTS_FLAG_SENDER, 0, data.str, data.len);
+        arena_release(&ptts_arena, mark);
+    }
+    else
+        pushed = helper_push(backend, PTTS_MSG_SPEAK, 0, 0, utterance->text, strlen(utterance->text) + 1);
+
+    if (!pushed)
+        return FALSE;
+    backend->busy_id = backend->next_id;
+    return TRUE;
+}
+
+/* name clips {{{2 */
+// The helper renders the names of online buddies into a bounded cache
+// while it has nothing else to do, and drops them when buddies go away.
+static void helper_warm(struct backend *backend, PurpleBuddy *buddy)
+{
+    struct arena_mark mark = arena_mark(&ptts_arena);
+    struct arena_string data = helper_strings(purple_buddy_get_name(buddy), purple_buddy_get_alias(buddy), NULL);
+    helper_push(backend, PTTS_MSG_WARM, 0, 0, data.str, data.len);
+    arena_release(&ptts_arena, mark);
+}
+
+static void helper_warm_all(struct backend *backend)
+{
+    PurpleBlistNode *node;
+    PurpleBuddy *buddy;
+
+    // clips are rendered in the current voice
+    helper_voice(backend);
+
+    for (node = purple_blist_get_root(); node; node = purple_blist_node_next(node, FALSE)) {
+        if (!PURPLE_BLIST_NODE_IS_BUDDY(node))
+            continue;
+        buddy = (PurpleBuddy*) node;
+        if (PURPLE_BUDDY_IS_ONLINE(buddy))
+            helper_warm(backend, buddy);
+    }
+}
+
+static void helper_evict(struct backend *backend, PurpleBuddy *buddy)
+{
+    const gchar *who = purple_buddy_get_name(buddy);
+    helper_push(backend, PTTS_MSG_EVICT, 0, 0, who, strlen(who) + 1);
+}
+
+/* speech server {{{2 */
+// SSIP is a line protocol: commands and data end in CRLF, every command
+// is answered by "NNN-text" continuation lines and a final "NNN text"
+// line. Codes from 300 up are errors.
+static gchar* ssip_socket_path(struct backend *backend)
+{
+    const gchar *address = getenv("SPEECHD_ADDRESS");
+
+    if (backend->socket && *backend->socket)
+        return g_strdup(backend->socket);
+    if (address && g_str_has_prefix(address, "unix_socket:"))
+        return g_strdup(address + strlen("unix_socket:"));
+    return g_build_filename(g_get_user_runtime_dir(), BACKEND_SSIP_SOCKET, NULL);
+}
+
+static void ssip_stop(struct backend *backend)
+{
+    purple_input_remove(backend->ssip_read_watch);
+    if (backend->ssip_write_watch)
+        purple_input_remove(backend->ssip_write_watch);
+    close(backend->ssip_fd);
+    g_string_free(backend->ssip_input, TRUE);
+    g_string_free(backend->ssip_output, TRUE);
+
+    backend->ssip_fd = -1;
+    backend->ssip_read_watch = backend->ssip_write_watch = 0;
+    backend->ssip_input = backend->ssip_output = NULL;
+    backend->ssip_pending = 0;
+    purple_debug_info(PLUGIN_NAME, "disconnected profile %s\n", backend->name);
+}
+
+static void ssip_writable(gpointer data, gint fd, PurpleInputCondition cond);
+
+// write as much of the output buffer as the socket takes, the rest is
+// sent when it becomes writable again
+static gboolean ssip_flush(struct backend *backend)
+{
+    GString *output = backend->ssip_output;
+    ssize_t written;
+
+    while (output->len > 0) {
+        written = send(backend->ssip_fd, output->str, output->len, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (written < 0) {
+            purple_debug_error(PLUGIN_NAME, "Lost speech server of profile %s: '%s'\n", backend->name, strerror(errno));
+            // reconnect with the next message
+            backend_stop(backend);
+            return FALSE;
+        }
+        g_string_erase(output, 0, written);
+    }
+
+    if (output->len > 0 && !backend->ssip_write_watch)
+        backend->ssip_write_watch = purple_input_add(backend->ssip_fd, PURPLE_INPUT_WRITE, ssip_writable, backend);
+    else if (output->len == 0 && backend->ssip_write_watch) {
+        purple_input_remove(backend->ssip_write_watch);
+        backend->ssip_write_watch = 0;
+    }
+    return TRUE;
+}
+
+static void ssip_writable(gpointer data, gint fd, PurpleInputCondition cond)
+{
+    ssip_flush(data);
+}
+
+// queue a request that is answered by the given number of replies
+static gboolean ssip_send(struct backend *backend, guint replies, const gchar *format, ...) __attribute__((format(printf,3,4)));
+static gboolean ssip_send(struct backend *backend, guint replies, const gchar *format, ...)
+{
+    va_list ap;
+
+    // formatted in place, a command is never cut short of its CRLF. The
+    // output buffer only grows while the server lags behind.
+    va_start(ap, format);
+    g_string_append_vprintf(backend->ssip_output, format, ap);
+    va_end(ap);
+
+    backend->ssip_pending += replies;
+    return ssip_flush(backend);
+}
+
+static void ssip_readable(gpointer data, gint fd, PurpleInputCondition cond)
+{
+    struct backend *backend = data;
+    GString *input = backend->ssip_input;
+    gchar buffer[1024], *eol;
+    ssize_t len;
+    gsize line;
+
+    len = recv(fd, buffer, sizeof(buffer), 0);
+    if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (len <= 0) {
+        purple_debug_error(PLUGIN_NAME, "Speech server of profile %s closed the connection\n", backend->name);
+        backend_stop(backend);
+        return;
+    }
+
+    g_string_append_len(input, buffer, len);
+    while ((eol = memchr(input->str, '\n', input->len)) != NULL) {
+        line = eol - input->str;
+        if (line >= 4 && input->str[3] == ' ') {
+            if (backend->ssip_pending > 0)
+                --backend->ssip_pending;
+            if (input->str[0] >= '3')
+                purple_debug_error(PLUGIN_NAME, "Speech server of profile %s: %.*s\n",
+                        backend->name, (int) line, input->str);
+        }
+        g_string_erase(input, 0, line + 1);
+    }
+}
+
+static gboolean ssip_start(struct backend *backend)
+{
+    struct sockaddr_un addr;
+    gchar *path;
+    int fd;
+
+    // don't try to connect for every message while the server is down
+    if (backend->ssip_failed
+            && g_get_monotonic_time() - backend->ssip_failed < BACKEND_SSIP_RETRY * G_USEC_PER_SEC)
+        return FALSE;
+
+    path = ssip_socket_path(backend);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        purple_debug_error(PLUGIN_NAME, "Speech server socket path is too long: %s\n", path);
+        backend->ssip_failed = g_get_monotonic_time();
+        g_free(path);
+        return FALSE;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        purple_debug_error(PLUGIN_NAME, "Cannot connect to %s: '%s'\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        backend->ssip_failed = g_get_monotonic_time();
+        g_free(path);
+        return FALSE;
+    }
+    purple_debug_info(PLUGIN_NAME, "connected profile %s to %s\n", backend->name, path);
+    g_free(path);
+
+    backend->ssip_fd = fd;
+    backend->ssip_failed = 0;
+    backend->ssip_pending = 0;
+    backend->ssip_input = g_string_new(NULL);
+    backend->ssip_output = g_string_new(NULL);
+    backend->ssip_read_watch = purple_input_add(fd, PURPLE_INPUT_READ, ssip_readable, backend);
+    backend->voice_sent = FALSE;
+
+    return ssip_send(backend, 1, "SET self CLIENT_NAME %s:pidgin-tts:%s\r\n", g_get_user_name(), backend->name);
+}
+
+// keyword hits use the speech-dispatcher priorities: "message" is spoken
+// before queued text, "important" also interrupts it
+static gboolean ssip_speak(struct backend *backend, const gchar *message, enum priority priority)
+{
+    GString *output = backend->ssip_output;
+    const gchar *line, *eol;
+    int volume;
+
+    if (output->len > BACKEND_SSIP_BACKLOG) {
+        purple_debug_error(PLUGIN_NAME, "Speech server of profile %s is not reading, dropping message\n", backend->name);
+        return FALSE;
+    }
+
+    if (!backend->voice_sent) {
+        // espeak volumes go from 0 to 200, SSIP volumes from -100 to 100
+        volume = CLAMP((backend->volume ? atoi(backend->volume) : 100) - 100, -100, 100);
+        backend_voice_sent(backend);
+        if (!ssip_send(backend, 2, "SET self LANGUAGE %s\r\nSET self VOLUME %d\r\n",
+                    backend->language ? backend->language : "en", volume))
+            return FALSE;
+    }
+
+    if (priority != PRIORITY_NORMAL && !ssip_send(backend, 1, "SET self PRIORITY %s\r\n",
+                priority == PRIORITY_INTERRUPT ? "important" : "message"))
+        return FALSE;
+
+    // the text ends with a line holding a single dot, so leading dots are doubled
+    g_string_append(output, "SPEAK\r\n");
+    for (line = message; ; line = eol + 1) {
+        eol = strchr(line, '\n');
+        if (line[0] == '.')
+            g_string_append_c(output, '.');
+        g_string_append_len(output, line, eol ? eol - line : (gssize) strlen(line));
+        g_string_append(output, "\r\n");
+        if (eol == NULL)
+            break;
+    }
+    if (!ssip_send(backend, 2, ".\r\n"))
+        return FALSE;
+    return priority == PRIORITY_NORMAL || ssip_send(backend, 1, "SET self PRIORITY text\r\n");
+}
+
+/* child process {{{2 */
+static gboolean backend_running(struct backend *backend)
+{
+    return backend->queue_pid != 0 || backend->ssip_fd >= 0;
+}
+
+static void backend_stop(struct backend *backend)
+{
+    if (backend->queue_timer) {
+        purple_timeout_remove(backend->queue_timer);
+        backend->queue_timer = 0;
+    }
+    if (backend->queue_stdin >= 0)
+        shell_stop(backend);
+    if (backend->shm != NULL)
+        helper_stop(backend);
+    if (backend->ssip_fd >= 0)
+        ssip_stop(backend);
+
+    // waiting messages are handed to the next child
+    backend->busy = FALSE;
+}
+
+static gboolean backend_idle(gpointer data)
+{
+    struct backend *backend = data;
+    gint64 idle = (g_get_monotonic_time() - backend->queue_used) / G_USEC_PER_SEC;
+    int timeout = pref_get_idle_timeout();
+
+    backend->queue_timer = 0;
+    if (timeout <= 0)
+        return FALSE;
+
+    if (backend->busy)
+        backend->queue_timer = purple_timeout_add_seconds(timeout, backend_idle, backend);
+    else if (idle >= timeout)
+        backend_stop(backend);
+    else
+        backend->queue_timer = purple_timeout_add_seconds(timeout - idle, backend_idle, backend);
+    return FALSE;
+}
+
+static void backend_rearm(struct backend *backend)
+{
+    int timeout = pref_get_idle_timeout();
+
+    if (backend->queue_timer) {
+        purple_timeout_remove(backend->queue_timer);
+        backend->queue_timer = 0;
+    }
+    if (backend_running(backend) && timeout > 0)
+        backend->queue_timer = purple_timeout_add_seconds(timeout, backend_idle, backend);
+}
+
+static gboolean backend_start(struct backend *backend)
+{
+    backend->queue_used = g_get_monotonic_time();
+
+    if (!backend_running(backend)) {
+        gboolean started;
+        switch (backend->type) {
+            case BACKEND_HELPER: started = helper_start(backend); break;
+            case BACKEND_SSIP:   started = ssip_start(backend);   break;
+            default:             started = shell_start(backend);  break;
+        }
+        if (!started)
+            return FALSE;
+        METRIC_ADD(backend_starts, 1);
+        backend_rearm(backend);
+    }
+    return TRUE;
+}
+
+/* speech queue {{{2 */
+// cut the message the child is speaking, the next one follows right away
+static void backend_interrupt(struct backend *backend)
+{
+    if (!backend->busy)
+        return;
+
+    backend->interrupting = TRUE;
+    if (backend->shm != NULL)
+        __atomic_store_n(&backend->shm->cancel, backend->busy_id, __ATOMIC_RELEASE);
+    else if (backend->queue_child > 0)
+        shell_interrupt(backend->queue_child);
+}
+
+static void utterance_free(gpointer data, gpointer user_data)
+{
+    struct utterance *utterance = data;
+    g_free(utterance->who);
+    g_free(utterance->name);
+    g_free(utterance->text);
+    g_free(utterance);
+}
+
+// hand the next message to the child, keyword hits first
+static gboolean backend_send(struct backend *backend, enum lane lane, struct utterance *utterance)
+{
+    gboolean sent = backend->type == BACKEND_HELPER
+        ? helper_speak(backend, utterance)
+        : shell_write(backend, backend->queue_stdin, utterance->text);
+
+    if (sent) {
+        backend->busy = TRUE;
+        backend->busy_lane = lane;
+        backend->busy_since = g_get_monotonic_time();
+        backend->interrupting = FALSE;
+    }
+    return sent;
+}
+
+static void backend_dispatch(struct backend *backend)
+{
+    struct utterance *utterance;
+    enum lane lane;
+
+    while (!backend->busy && backend_running(backend)) {
+        lane = g_queue_is_empty(&backend->lane[LANE_HIGH]) ? LANE_NORMAL : LANE_HIGH;
+        utterance = g_queue_pop_head(&backend->lane[lane]);
+        if (utterance == NULL)
+            break;
+
+        METRIC_ADD(queued, -1);
+        backend_send(backend, lane, utterance);
+        utterance_free(utterance, NULL);
+    }
+}
+
+static void backend_done(struct backend *backend)
+{
+    if (backend->busy)
+        metrics_observe(STAGE_SPEECH, g_get_monotonic_time() - backend->busy_since);
+    backend->busy = FALSE;
+    backend->queue_child = 0;
+    backend->queue_used = g_get_monotonic_time();
+    backend_dispatch(backend);
+}
+
+static gboolean backend_enqueue(struct backend *backend, const gchar *who, const gchar *name, const gchar *message, enum priority priority)
+{
+    enum lane lane = priority == PRIORITY_NORMAL ? LANE_NORMAL : LANE_HIGH;
+    struct utterance *utterance, now = { (gchar*) who, (gchar*) name, (gchar*) message };
+
+    // an idle backend takes the message right away, without a copy
+    if (!backend->busy && backend_running(backend)
+            && g_queue_is_empty(&backend->lane[LANE_NORMAL])
+            && g_queue_is_empty(&backend->lane[LANE_HIGH]))
+        return backend_send(backend, lane, &now);
+
+    if (lane == LANE_NORMAL && g_queue_get_length(&backend->lane[lane]) >= BACKEND_QUEUE_MAX) {
+        purple_debug_error(PLUGIN_NAME, "Too many messages waiting for profile %s, dropping message\n", backend->name);
+        return FALSE;
+    }
+    // waiting messages outlive the arena
+    utterance = g_new(struct utterance, 1);
+    utterance->who = g_strdup(who);
+    utterance->name = g_strdup(name);
+    utterance->text = g_strdup(message);
+    g_queue_push_tail(&backend->lane[lane], utterance);
+    METRIC_ADD(queued, 1);
+
+    if (priority == PRIORITY_INTERRUPT && backend->busy_lane == LANE_NORMAL)
+        backend_interrupt(backend);
+    backend_dispatch(backend);
+    return TRUE;
+}
+
+static void backend_clear(struct backend *backend)
+{
+    enum lane lane;
+    for (lane = 0; lane < LANES; ++lane) {
+        METRIC_ADD(queued, -(gint64) g_queue_get_length(&backend->lane[lane]));
+        g_queue_foreach(&backend->lane[lane], utterance_free, NULL);
+        g_queue_clear(&backend->lane[lane]);
+    }
+}
+
+// drop everything that is waiting for speech and silence the backend
+static void backend_cancel(struct backend *backend)
+{
+    backend_clear(backend);
+    if (backend->ssip_fd >= 0)
+        ssip_send(backend, 1, "CANCEL self\r\n");
+    else
+        backend_interrupt(backend);
+}
+
+/* compiling {{{2 */
+static void backend_release(struct backend *backend)
+{
+    g_free(backend->command);
+    g_free(backend->language);
+    g_free(backend->volume);
+    g_free(backend->socket);
+    g_free(backend->head);
+    g_free(backend->mid);
+    g_free(backend->tail);
+    g_list_free_full(backend->replacement, g_free);
+    g_list_free_full(backend->keywords, g_free);
+    dict_close(backend->dict);
+
+    backend->command = backend->language = backend->volume = backend->socket = NULL;
+    backend->head = backend->mid = backend->tail = NULL;
+    backend->replacement = backend->keywords = NULL;
+    backend->dict = NULL;
+    backend->compiled = FALSE;
+}
+
+// split the composed command line around the message and extra slots and
+// substitute command, language and volume once. Only %s and %% are
+// interpreted, like all the composition strings in use.
+static void backend_compile_compose(struct backend *backend, const gchar *compose, const gchar **params)
+{
+    GString *part[3];
+    guint slot = 0, current = 0;
+    const gchar *p;
+
+    part[0] = g_string_new(NULL);
+    part[1] = g_string_new(NULL);
+    part[2] = g_string_new(NULL);
+
+    for (p = compose; p && *p; ++p) {
+        if (p[0] == '%' && p[1] == 's') {
+            if (slot < 3)
+                g_string_append(part[current], params[slot] ? params[slot] : "");
+            else if (slot < 5)
+                current = slot - 2;
+            ++slot;
+            ++p;
+        }
+        else if (p[0] == '%' && p[1] == '%')
+            g_string_append_c(part[current], *p++);
+        else
+            g_string_append_c(part[current], *p);
+    }
+
+    backend->has_message = slot > 3;
+    backend->has_extra = slot > 4;
+    backend->head_len = part[0]->len;
+    backend->mid_len = part[1]->len;
+    backend->tail_len = part[2]->len;
+    backend->head = g_string_free(part[0], FALSE);
+    backend->mid = g_string_free(part[1], FALSE);
+    backend->tail = g_string_free(part[2], FALSE);
+}
+
+static void backend_compile(struct backend *backend)
+{
+    const gchar *params[3], *name, *socket;
+    enum backend_type type;
+    struct regex_rules *old;
+    GList *regex, *link;
+    const gchar *keyword;
+    gboolean announced = backend->announce;
+
+    // switching the backend type or server needs a different child
+    name = pp_get_string(PREFS_BACKEND, backend->name);
+    type = purple_strequal(name, BACKEND_HELPER_NAME) ? BACKEND_HELPER
+        : purple_strequal(name, BACKEND_SSIP_NAME) ? BACKEND_SSIP
+        : BACKEND_SHELL;
+    socket = pp_get_string(PREFS_SOCKET, backend->name);
+    if (type != backend->type || !purple_strequal(socket, backend->socket))
+        backend_stop(backend);
+
+    backend_release(backend);
+    backend->type = type;
+    backend->socket = g_strdup(socket);
+
+    params[0] = pp_get_string(PREFS_COMMAND, backend->name);
+    params[1] = pp_get_string(PREFS_LANGUAGE, backend->name);
+    params[2] = pp_get_string(PREFS_VOLUME, backend->name);
+    backend->command = g_strdup(params[0]);
+    backend->language = g_strdup(params[1]);
+    backend->volume = g_strdup(params[2]);
+    if (!purple_strequal(backend->language, backend->voice_language)
+            || !purple_strequal(backend->volume, backend->voice_volume))
+        backend->voice_sent = FALSE;
+    backend_compile_compose(backend, pp_get_string(PREFS_COMPOSE, backend->name), params);
+
+    backend->replacement = pp_get_string_list(PREFS_REPLACE, backend->name);
+    regex = pp_get_string_list(PREFS_REGEX, backend->name);
+    if (backend->regex != NULL && regex_same_table(backend->regex->table, regex))
+        g_list_free_full(regex, g_free);
+    else {
+        old = backend->regex;
+        backend->regex = regex_compile(regex, old);
+        regex_free(old);
+    }
+    backend->keywords = pp_get_string_list(PREFS_KEYWORDS, backend->name);
+    ptts_scan_init(&backend->keyword_leads);
+    for (link = backend->keywords; link; link = link->next) {
+        keyword = (const gchar*) link->data + (*(const gchar*) link->data == KEYWORD_INTERRUPT);
+        if (*keyword)
+            ptts_scan_add_nocase(&backend->keyword_leads, *keyword);
+    }
+    backend->keywords_active = pp_get_bool(PREFS_KEYS_ON, backend->name);
+    backend->keywords_interrupt = pp_get_bool(PREFS_KEYS_INT, backend->name);
+    backend->announce = pp_get_bool(PREFS_ANNOUNCE, backend->name);
+    backend->condense =
+        (pp_get_bool(PREFS_CONDENSE_URLS, backend->name) ? CONDENSE_URLS : 0)
+        | (pp_get_bool(PREFS_CONDENSE_CODE, backend->name) ? CONDENSE_CODE : 0)
+        | (pp_get_bool(PREFS_CONDENSE_EMOJI, backend->name) ? CONDENSE_EMOJI : 0);
+    backend->dict = dict_open(pp_get_string(PREFS_DICT, backend->name));
+
+    backend->compiled = TRUE;
+    purple_debug_info(PLUGIN_NAME, "compiled profile %s\n", backend->name);
+
+    // clips are only rendered anew for a different voice, or when names
+    // were not announced before
+    if (backend->announce && backend->shm != NULL && (!backend->voice_sent || !announced))
+        helper_warm_all(backend);
+}
+
+/* lookup {{{2 */
+static void backend_free(gpointer data)
+{
+    struct backend *backend = data;
+    backend_stop(backend);
+    backend_clear(backend);
+    backend_release(backend);
+    regex_free(backend->regex);
+    g_free(backend->voice_language);
+    g_free(backend->voice_volume);
+    g_free(backend->name);
+    g_free(backend);
+}
+
+static struct backend* backend_get(const gchar *name)
+{
+    struct backend *backend = g_hash_table_lookup(ptts_backends, name);
+    if (backend == NULL) {
+        backend = g_new0(struct backend, 1);
+        backend->name = g_strdup(name);
+        backend->queue_stdin = backend->queue_stdout = -1;
+        backend->ssip_fd = -1;
+        backend->input_fd = -1;
+        g_hash_table_insert(ptts_backends, backend->name, backend);
+    }
+    return backend;
+}
+
+static struct backend* backend_ready(struct backend *backend)
+{
+    if (!backend->compiled)
+        backend_compile(backend);
+    return backend;
+}
+
+static struct backend* backend_for(PurpleConversation *conv)
+{
+    struct backend *backend = conv ? conv_get_backend(conv) : NULL;
+
+    backend = backend ? backend : ptts_backend;
+    if (backend->compiled)
+        METRIC_ADD(profile_hits, 1);
+    else
+        METRIC_ADD(profile_misses, 1);
+    return backend_ready(backend);
+}
+
+static void backend_foreach_stop(gpointer key, gpointer value, gpointer data)
+{
+    backend_stop(value);
+}
+
+static void backend_foreach_rearm(gpointer key, gpointer value, gpointer data)
+{
+    backend_rearm(value);
+}
+
+static void backend_foreach_cancel(gpointer key, gpointer value, gpointer data)
+{
+    backend_cancel(value);
+}
+
+static void backend_foreach_warm(gpointer key, gpointer value, gpointer data)
+{
+    struct backend *backend = value;
+    if (backend->shm != NULL && backend->announce)
+        helper_warm(backend, data);
+}
+
+static void backend_foreach_evict(gpointer key, gpointer value, gpointer data)
+{
+    struct backend *backend = value;
+    if (backend->shm != NULL && backend->announce)
+        helper_evict(backend, data);
+}
+
+static void backend_foreach_log(gpointer key, gpointer value, gpointer data)
+{
+    struct backend *backend = value;
+    const gchar *child = backend->type == BACKEND_HELPER ? BACKEND_HELPER_BINARY : pref_get_shell();
+    gchar *path;
+
+    if (backend->type == BACKEND_SSIP) {
+        path = ssip_socket_path(backend);
+        if (backend_running(backend))
+            systemlog(data,
+                    "%s profile %s: connected to %s (%u replies outstanding)",
+                    PLUGIN_NAME,
+                    backend->name,
+                    path,
+                    backend->ssip_pending);
+        else
+            systemlog(data,
+                    "%s profile %s: not connected to %s",
+                    PLUGIN_NAME,
+                    backend->name,
+                    path);
+        g_free(path);
+    }
+
+    else if (backend_running(backend))
+        systemlog(data,
+                "%s profile %s: %s is running (pid %d)",
+                PLUGIN_NAME,
+                backend->name,
+                child,
+                backend->queue_pid);
+    else
+        systemlog(data,
+                "%s profile %s: %s is stopped",
+                PLUGIN_NAME,
+                backend->name,
+                child);
+}
+
+// invalidate profiles when their prefs change, and switch the default
+// profile by swapping a pointer
+static void backend_pref_changed(const char *name, PurplePrefType type, gconstpointer value, gpointer data)
+{
+    struct backend *backend;
+    gchar *profile;
+    const gchar *tail;
+
+    if (purple_strequal(name, PREFS_PROFILE)) {
+        ptts_backend = backend_get(value);
+        return;
+    }
+
+    if (!g_str_has_prefix(name, PREFS_PROFILE "/"))
+        return;
+
+    tail = name + strlen(PREFS_PROFILE "/");
+    profile = g_strndup(tail, strcspn(tail, "/"));
+    backend = g_hash_table_lookup(ptts_backends, profile);
+    if (backend != NULL)
+        backend->compiled = FALSE;
+    g_free(profile);
+}
+
+// Condensation {{{1
+// Technical chat traffic takes minutes to read out literally. This stage
+// runs on the stripped message, before the dictionary and replacement
+// tables, and shortens it in a single pass over the text. URLs are cut
+// down to their host, code blocks and long hex or base64 runs become
+// placeholders, emoji sequences become their name or nothing.
+// The placeholders go through the replacement table like any other text.
+
+/* code blocks {{{2 */
+// stack frames, indented lines and statements
+static gboolean condense_code_line(const gchar *line, gsize len)
+{
+    gsize i = 0;
+
+    while (len > 0 && (line[len-1] == ' ' || line[len-1] == '\r'))
+        --len;
+    if (len == 0)
+        return FALSE;
+
+    if (line[0] == '\t' || (len >= 4 && strncmp(line, "    ", 4) == 0))
+        return TRUE;
+
+    while (i < len && g_ascii_isspace(line[i]))
+        ++i;
+    if ((len - i > 3 && strncmp(line + i, "at ", 3) == 0 && memchr(line + i, '(', len - i))
+            || (len - i > 6 && strncmp(line + i, "File \"", 6) == 0))
+        return TRUE;
+
+    return strchr(";{}", line[len-1]) != NULL;
+}
+
+// length of the code block at the start of a line, 0 if there is none
+static gsize condense_code_block(const gchar *p)
+{
+    const gchar *end, *line;
+    guint lines = 0;
+
+    // fenced, up to the closing fence or the end of the message
+    if (strncmp(p, CONDENSE_FENCE, strlen(CONDENSE_FENCE)) == 0) {
+        end = strstr(p + strlen(CONDENSE_FENCE), CONDENSE_FENCE);
+        return end ? (gsize) (end - p) + strlen(CONDENSE_FENCE) : strlen(p);
+    }
+
+    // a run of lines that look like code
+    for (line = p; *line; line = end + 1) {
+        end = strchr(line, '\n');
+        if (end == NULL)
+            end = line + strlen(line);
+        if (!condense_code_line(line, end - line))
+            break;
+        ++lines;
+        if (*end == 0)
+            return lines >= CONDENSE_CODE_LINES ? (gsize) (end - p) : 0;
+    }
+    return lines >= CONDENSE_CODE_LINES ? (gsize) (line - p) : 0;
+}
+
+/* tokens {{{2 */
+// length of the URL at p, its host is appended to out
+static gsize condense_url(const gchar *p, struct arena_string *out)
+{
+    static const gchar *schemes[] = { "http://", "https://", "ftp://", "www.", NULL };
+    const gchar *host = NULL, *end;
+    guint i;
+
+    for (i = 0; schemes[i]; ++i)
+        if (g_ascii_strncasecmp(p, schemes[i], strlen(schemes[i])) == 0) {
+            host = p + strlen(schemes[i]);
+            break;
+        }
+    if (host == NULL)
+        return 0;
+
+    if (g_ascii_strncasecmp(host, "www.", 4) == 0)
+        host += 4;
+    for (end = host; *end && (g_ascii_isalnum(*end) || *end == '.' || *end == '-'); ++end)
+        ;
+    if (end == host)
+        return 0;
+
+    arena_string_append_len(out, host, end - host);
+    while (*end && !g_ascii_isspace(*end))
+        ++end;
+    // links in parentheses, as purple_markup_strip_html writes them
+    if (end[-1] == ')' && !memchr(p, '(', end - p))
+        --end;
+    return end - p;
+}
+
+// length of a hex or base64 run at p, its placeholder is appended to out
+static gsize condense_run(const gchar *p, struct arena_string *out)
+{
+    const gchar *end = p;
+    guint hex = 0, upper = 0, lower = 0, digit = 0, other = 0;
+
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        end += 2;
+    for ( ; *end && !g_ascii_isspace(*end); ++end) {
+        if (g_ascii_isxdigit(*end))
+            ++hex;
+        if (g_ascii_isupper(*end))
+            ++upper;
+        else if (g_ascii_islower(*end))
+            ++lower;
+        else if (g_ascii_isdigit(*end))
+            ++digit;
+        else if (!strchr("+/=_-", *end))
+            ++other;
+    }
+    if (other > 0 && strchr(".,;:!?)", end[-1]) && other == 1)
+        --end;      // sentence punctuation
+    else if (other > 0)
+        return 0;
+
+    // hashes, ids and UUIDs
+    if (hex >= CONDENSE_RUN_MIN && hex + (end - p) / 8 >= (guint) (end - p)) {
+        arena_string_append(out, CONDENSE_HEX_TEXT);
+        return end - p;
+    }
+    if ((guint) (end - p) >= CONDENSE_BASE64_MIN && upper && lower && digit) {
+        arena_string_append(out, CONDENSE_BASE64_TEXT);
+        return end - p;
+    }
+    return 0;
+}
+
+/* emoji {{{2 */
+// names for the most common emoji, sorted by code point
+static const struct {
+    gunichar c;
+    const gchar *name;
+} condense_emoji_names[] = {
+    { 0x2705,  "check mark" },
+    { 0x2728,  "sparkles" },
+    { 0x274C,  "cross mark" },
+    { 0x2764,  "heart" },
+    { 0x2B50,  "star" },
+    { 0x1F389, "party popper" },
+    { 0x1F44B, "waving hand" },
+    { 0x1F44C, "ok hand" },
+    { 0x1F44D, "thumbs up" },
+    { 0x1F44E, "thumbs down" },
+    { 0x1F44F, "clapping hands" },
+    { 0x1F494, "broken heart" },
+    { 0x1F4A9, "pile of poo" },
+    { 0x1F4AA, "flexed biceps" },
+    { 0x1F525, "fire" },
+    { 0x1F600, "grinning face" },
+    { 0x1F601, "beaming face" },
+    { 0x1F602, "tears of joy" },
+    { 0x1F603, "grinning face" },
+    { 0x1F604, "grinning face" },
+    { 0x1F605, "sweat smile" },
+    { 0x1F606, "laughing" },
+    { 0x1F609, "winking face" },
+    { 0x1F60A, "smiling face" },
+    { 0x1F60D, "heart eyes" },
+    { 0x1F60E, "sunglasses" },
+    { 0x1F610, "neutral face" },
+    { 0x1F612, "unamused face" },
+    { 0x1F614, "pensive face" },
+    { 0x1F618, "blowing a kiss" },
+    { 0x1F61B, "tongue out" },
+    { 0x1F61C, "winking tongue" },
+    { 0x1F622, "crying face" },
+    { 0x1F62D, "loudly crying" },
+    { 0x1F631, "screaming face" },
+    { 0x1F633, "flushed face" },
+    { 0x1F642, "slightly smiling" },
+    { 0x1F643, "upside down face" },
+    { 0x1F644, "eye roll" },
+    { 0x1F64F, "folded hands" },
+    { 0x1F680, "rocket" },
+    { 0x1F914, "thinking face" },
+    { 0x1F923, "rolling on the floor laughing" },
+    { 0x1F937, "shrug" },
+    { 0x1F973, "partying face" },
+    { 0x1F97A, "pleading face" },
+};
+
+static gboolean condense_emoji_base(gunichar c)
+{
+    return (c >= 0x2600 && c <= 0x27BF)
+        || (c >= 0x2B00 && c <= 0x2BFF)
+        || (c >= 0x1F000 && c <= 0x1FAFF);
+}
+
+// variation selectors, skin tones, keycaps and tags
+static gboolean condense_emoji_modifier(gunichar c)
+{
+    return c == 0xFE0E || c == 0xFE0F || c == 0x20E3
+        || (c >= 0x1F3FB && c <= 0x1F3FF)
+        || (c >= 0xE0020 && c <= 0xE007F);
+}
+
+static const gchar* condense_emoji_name(gunichar c)
+{
+    gint low = 0, high = G_N_ELEMENTS(condense_emoji_names) - 1, mid;
+
+    while (low <= high) {
+        mid = (low + high) / 2;
+        if (condense_emoji_names[mid].c == c)
+            return condense_emoji_names[mid].name;
+        if (condense_emoji_names[mid].c < c)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return NULL;
+}
+
+// length of the emoji sequence at p, its name is stored in name
+static gsize condense_emoji(const gchar *p, const gchar **name)
+{
+    const gchar *q = p;
+    gunichar c = g_utf8_get_char(q);
+
+    if (!condense_emoji_base(c) || condense_emoji_modifier(c))
+        return 0;
+
+    // a sequence is named after its first emoji
+    *name = condense_emoji_name(c);
+    for (q = g_utf8_next_char(q); *q; ) {
+        c = g_utf8_get_char(q);
+        if (condense_emoji_modifier(c))
+            q = g_utf8_next_char(q);
+        else if (c == 0x200D && condense_emoji_base(g_utf8_get_char(g_utf8_next_char(q))))
+            q = g_utf8_next_char(g_utf8_next_char(q));
+        else
+            break;
+    }
+    return q - p;
+}
+
+/* condensing {{{2 */
+static gboolean condense_token_start(const struct arena_string *out)
+{
+    return out->len == 0 || strchr(" \t\n(<[\"", out->str[out->len-1]) != NULL;
+}
+
+static gchar* condense(struct arena *arena, guint rules, const gchar *text)
+{
+    struct arena_string string, *out = &string;
+    const gchar *p = text, *name, *last_name = NULL;
+    gsize len;
+    gboolean line_start = TRUE, after_emoji = FALSE;
+
+    arena_string_init(out, arena, strlen(text));
+    while (*p) {
+        if (line_start && (rules & CONDENSE_CODE) && (len = condense_code_block(p)) > 0) {
+            // newlines are stripped later, the placeholder keeps its blanks
+            if (out->len > 0 && out->str[out->len-1] != ' ')
+                arena_string_append_c(out, ' ');
+            arena_string_append(out, CONDENSE_CODE_TEXT " ");
+            p += len;
+            continue;
+        }
+        line_start = *p == '\n';
+
+        if ((guchar) *p >= 0xE2 && (rules & CONDENSE_EMOJI) && (len = condense_emoji(p, &name)) > 0) {
+            // a row of the same emoji is said once
+            if (name != NULL && !(after_emoji && name == last_name)) {
+                if (!condense_token_start(out))
+                    arena_string_append_c(out, ' ');
+                arena_string_append(out, name);
+            }
+            if (name != NULL)
+                last_name = name;
+            after_emoji = TRUE;
+            p += len;
+            continue;
+        }
+
+        if (after_emoji) {
+            // no doubled blanks where an emoji was dropped
+            if (g_ascii_isspace(*p)) {
+                if (out->len == 0 || !g_ascii_isspace(out->str[out->len-1]))
+                    arena_string_append_c(out, *p);
+                ++p;
+                continue;
+            }
+            if (!condense_token_start(out))
+                arena_string_append_c(out, ' ');
+            after_emoji = FALSE;
+        }
+
+        if (g_ascii_isalnum(*p) && condense_token_start(out)) {
+            if (((rules & CONDENSE_URLS) && (len = condense_url(p, out)) > 0)
+                    || ((rules & CONDENSE_CODE) && (len = condense_run(p, out)) > 0)) {
+                p += len;
+                continue;
+            }
+        }
+
+        arena_string_append_c(out, *p++);
+    }
+
+    return out->str;
+}
+
+
+// Business logic {{{1
+// remove the bytes in scan from text {{{2
+static void strip_bytes(const struct ptts_scan *scan, gchar *text)
+{
+    gsize len = strlen(text), i = 0, out = 0, next;
+
+    while (i < len) {
+        next = i + ptts_scan_find(scan, text + i, len - i);
+        memmove(text + out, text + i, next - i);
+        out += next - i;
+        i = next + 1;
+    }
+    text[out] = 0;
+}
+
+// strip markup {{{2
+// libpurple knows which tags are dropped with their contents and how lists,
+// tables and links are read, the result is moved into the arena
+static gchar* markup_strip(struct arena *arena, const gchar *html)
+{
+    gchar *text = purple_markup_strip_html(html);
+    gchar *copy = arena_strndup(arena, text, strlen(text));
+
+    g_free(text);
+    return copy;
+}
+
+// replace all occurences of pattern {{{2
+static gchar* replace_all(struct arena *arena, const gchar *text, const gchar *pattern, const gchar *replacement)
+{
+    struct arena_string out;
+    gsize len = strlen(pattern);
+    const gchar *p = text, *match;
+
+    if (len == 0 || (match = strstr(text, pattern)) == NULL)
+        return (gchar*) text;
+
+    arena_string_init(&out, arena, strlen(text));
+    do {
+        arena_string_append_len(&out, p, match - p);
+        arena_string_append(&out, replacement);
+        p = match + len;
+    } while ((match = strstr(p, pattern)) != NULL);
+    arena_string_append(&out, p);
+    return out.str;
+}
+
+// analyse message text {{{2
+// the text is allocated from ptts_arena, and valid until it is reset
+static gboolean analyse(struct backend *backend, const gchar* _buffer, gchar **text)
+{
+    GList* table;
+    gchar *buffer;
+    gsize len = strlen(_buffer);
+
+    // copy buffer and remove <html-tags>, apostrophes \', and newlines \n.
+    // Most messages are plain text and need no markup parser.
+    if (ptts_scan_find(&scan_markup, _buffer, len) < len)
+        buffer = markup_strip(&ptts_arena, _buffer);
+    else
+        buffer = arena_strndup(&ptts_arena, _buffer, len);
+    if (backend->condense)
+        buffer = condense(&ptts_arena, backend->condense, buffer);
+    strip_bytes(&scan_strip, buffer);
+
+    // look up the compiled dictionary
+    if (backend->dict != NULL)
+        buffer = dict_apply(&ptts_arena, backend->dict, buffer);
+
+    // replace
+    table = backend->replacement;
+
+    for (table = g_list_first(table); table != NULL; table = g_list_nth(table, 2))
+        buffer = replace_all(&ptts_arena, buffer, g_list_nth_data(table, 0), g_list_nth_data(table, 1));
+
+    // all regex rules in one scan
+    if (backend->regex != NULL && backend->regex->regex != NULL)
+        buffer = regex_apply(&ptts_arena, backend->regex, buffer);
+
+    *text = buffer;
+    return TRUE;
+}
+
+// execute espeak {{{2
+// who and name announce the sender, or are NULL
+static gboolean tts(struct backend *backend, const gchar *who, const gchar *name, gchar *message, enum priority priority)
+{
+    gboolean spoken;
+
+    purple_debug_info(PLUGIN_NAME, "Echoing: '%s'\n", message);
+
+    if (backend->type == BACKEND_SHELL && !backend->has_message) {
+        purple_debug_error(PLUGIN_NAME, "Profile %s composes no message\n", backend->name);
+        return FALSE;
+    }
+
+    // only the helper has name clips, everybody else says the name
+    if (name != NULL && (backend->type != BACKEND_HELPER || ptts_sink == SINK_NULL)) {
+        message = arena_printf(&ptts_arena, ANNOUNCE_FORMAT, name, message);
+        strip_bytes(&scan_strip, message);
+        who = name = NULL;
+    }
+
+    // the null sink measures composing only
+    if (ptts_sink == SINK_NULL)
+        spoken = shell_write(backend, ptts_sink_null, message);
+    else if (!backend_start(backend))
+        spoken = FALSE;
+    else if (backend->type == BACKEND_SSIP)
+        spoken = ssip_speak(backend, message, priority);
+    else
+        spoken = backend_enqueue(backend, who, name, message, priority);
+
+    return spoken;
 }
 
-// Business logic {{{1
-// analyse message text {{{2
-static gboolean analyse(const gchar* _buffer, gchar **text)
-{
-    GList* table;
-    gchar *buffer, *tmpbuffer;
+// user presence {{{2
+// The user reads the focused conversation anyway, and sees new messages
+// while they are chatting. While they are away or idle everything is spoken.
+// Both rules are opt-in, so an upgrade does not silence anything.
+static gint64 ptts_user_active;             // last activity, monotonic
+static guint ptts_suppressed_focus, ptts_suppressed_active;
+static gdouble ptts_suppressed_seconds;
 
-    // copy buffer and remove <html-tags>, apostrophes \', and newlines \n
-    buffer = purple_markup_strip_html(_buffer);
-    purple_str_strip_char(buffer, '\'');
-    purple_str_strip_char(buffer, '\n');
+static void user_activity(void)
+{
+    ptts_user_active = g_get_monotonic_time();
+}
 
-    // replace
-    table = pref_get_replacement();
+static gboolean user_away(PurpleAccount *account)
+{
+    PurpleStatusPrimitive status = purple_savedstatus_get_type(purple_savedstatus_get_current());
+    return status == PURPLE_STATUS_AWAY || status == PURPLE_STATUS_EXTENDED_AWAY
+        || (account != NULL && purple_presence_is_idle(purple_account_get_presence(account)));
+}
 
-    for (table = g_list_first(table); table != NULL; table = g_list_nth(table, 2)) {
-        tmpbuffer = purple_strreplace(buffer, g_list_nth_data(table, 0), g_list_nth_data(table, 1));
-        g_free(buffer);
-        buffer = tmpbuffer;
+// rough duration of the message when spoken
+static gdouble speech_seconds(const gchar *message)
+{
+    gboolean tag = FALSE;
+    guint chars = 0;
+
+    for ( ; *message; ++message) {
+        if (*message == '<')
+            tag = TRUE;
+        else if (*message == '>')
+            tag = FALSE;
+        else if (!tag && ((guchar) *message & 0xC0) != 0x80)
+            ++chars;
     }
-
-    *text = buffer;
-    return TRUE;
+    return chars / SPEECH_CHARS_PER_SECOND;
 }
 
-// execute espeak {{{2
-static gboolean tts(PurpleConversation *conv, gchar *message)
+// conv is NULL for the first message of a new conversation, which has no
+// window that could have the focus yet
+static gboolean suppress_message(PurpleAccount *account, PurpleConversation *conv, const gchar *message)
 {
-    purple_debug_info(PLUGIN_NAME, "Echoing: '%s'\n", message);
+    gint activity = pref_get_activity();
 
-    int written = dprintf(ptts_queue_stdin,
-        pref_get_compose(),
-        pref_get_command(),
-        pref_get_language(),
-        pref_get_volume(),
-        message,
-        "\n");
+    if (user_away(account))
+        return FALSE;
 
-    if (written < 0) {
-        purple_debug_error(PLUGIN_NAME, "Error while executing %s: '%s'\n", pref_get_command(), strerror(errno));
+    if (pref_get_focus() && conv != NULL && purple_conversation_has_focus(conv))
+        ++ptts_suppressed_focus;
+    else if (activity > 0 && ptts_user_active != 0
+            && g_get_monotonic_time() - ptts_user_active < activity * G_USEC_PER_SEC)
+        ++ptts_suppressed_active;
+    else
         return FALSE;
-    }
 
+    ptts_suppressed_seconds += speech_seconds(message);
     return TRUE;
 }
 
-// incoming message {{{2
-static gboolean process_message(PurpleConversation *conv, const gchar* message)
+static void presence_log(PurpleConversation *conv)
 {
-    gchar* text;
-    GList* keywords;
-    gboolean keyword_found = FALSE;
+    systemlog(conv,
+            "%s suppressed %u messages in the focused conversation and %u while you were active, about %.0f seconds of speech",
+            PLUGIN_NAME,
+            ptts_suppressed_focus,
+            ptts_suppressed_active,
+            ptts_suppressed_seconds);
+}
 
+// incoming message {{{2
+// whether messages in conv may be spoken at all
+static gboolean conv_may_speak(PurpleConversation *conv)
+{
     if (conv_get_inactive(conv))
         return FALSE;
+    return conv_get_active(conv) || pref_get_active() || backend_for(conv)->keywords_active;
+}
 
-    if (!conv_get_active(conv) && !pref_get_active()) {
-        if (pref_get_keywords_active()) {
-            keywords = pref_get_keywords();
-            for (keywords = g_list_first(keywords); keywords; keywords = g_list_next(keywords)) {
-                if (g_strstr_len(message, -1, g_list_nth_data(keywords, 0)) != NULL) {
-                    keyword_found = TRUE;
-                    break;
-                }
-            }
+// name to announce for who, the buddy alias if there is one
+static const gchar* sender_name(PurpleAccount *account, const gchar *who)
+{
+    PurpleBuddy *buddy = account ? purple_find_buddy(account, who) : NULL;
+    return buddy ? purple_buddy_get_alias(buddy) : who;
+}
+
+// keywords are matched case insensitively, only where a message has the
+// lead byte of one of them
+static enum priority keyword_priority(struct backend *backend, const gchar *message)
+{
+    struct ptts_scan_cursor cursor;
+    enum priority priority = PRIORITY_NORMAL;
+    gsize len = strlen(message), offset;
+    const gchar *keyword;
+    GList *link;
+
+    ptts_scan_start(&cursor, message, len);
+    while ((offset = ptts_scan_next(&backend->keyword_leads, &cursor)) < len) {
+        for (link = backend->keywords; link; link = link->next) {
+            keyword = link->data;
+            if (*keyword == KEYWORD_INTERRUPT && keyword[1]
+                    && g_ascii_strncasecmp(message + offset, keyword + 1, strlen(keyword + 1)) == 0)
+                return PRIORITY_INTERRUPT;
+            if (*keyword && g_ascii_strncasecmp(message + offset, keyword, strlen(keyword)) == 0)
+                priority = backend->keywords_interrupt ? PRIORITY_INTERRUPT : PRIORITY_HIGH;
         }
-        if (!keyword_found)
-            return FALSE;
     }
-    if (!analyse(message, &text))
+    return priority;
+}
+
+// whether the message was spoken or queued. Live messages are not spoken
+// while the user reads them anyway.
+static gboolean process_message(PurpleAccount *account, PurpleConversation *conv, const gchar *who, const gchar* message, gboolean live)
+{
+    gchar* text;
+    enum priority priority = PRIORITY_NORMAL;
+    struct backend *backend;
+    gint64 start = g_get_monotonic_time(), now;
+    gboolean spoken;
+
+    METRIC_ADD(received, 1);
+    arena_begin(&ptts_arena);
+    if (conv_get_inactive(conv)) {
+        METRIC_ADD(filtered, 1);
         return FALSE;
+    }
 
-    tts(conv, text);
-    g_free(text);
-    return TRUE;
+    // keyword hits are spoken even when tts is off, and before the backlog
+    backend = backend_for(conv);
+    if (backend->keywords_active)
+        priority = keyword_priority(backend, message);
+    if (priority == PRIORITY_NORMAL && !conv_get_active(conv) && !pref_get_active()) {
+        METRIC_ADD(filtered, 1);
+        return FALSE;
+    }
+
+    // keyword hits are always spoken, everything else only if it is news
+    if (live && priority == PRIORITY_NORMAL && suppress_message(account, conv, message)) {
+        METRIC_ADD(suppressed, 1);
+        return FALSE;
+    }
+    now = g_get_monotonic_time();
+    metrics_observe(STAGE_FILTER, now - start);
+    start = now;
+
+    if (!analyse(backend, message, &text)) {
+        METRIC_ADD(filtered, 1);
+        return FALSE;
+    }
+    now = g_get_monotonic_time();
+    metrics_observe(STAGE_ANALYSE, now - start);
+    start = now;
+
+    if (backend->announce && who != NULL && *who)
+        spoken = tts(backend, who, sender_name(account, who), text, priority);
+    else
+        spoken = tts(backend, NULL, NULL, text, priority);
+    arena_reset(&ptts_arena);
+
+    metrics_observe(STAGE_DISPATCH, g_get_monotonic_time() - start);
+    if (spoken)
+        METRIC_ADD(spoken, 1);
+    else
+        METRIC_ADD(dropped, 1);
+    return spoken;
 }
 
 static gboolean message_receive(PurpleAccount *account, const gchar *who, gchar *message, PurpleConversation *conv, PurpleMessageFlags flags)
 {
-    process_message(conv, message);
+    if (ptts_trace_file != NULL)
+        trace_write(conv, who, message, flags);
+
+    process_message(account, conv, who, message, TRUE);
     return FALSE;
 }
 
+static void message_sent(void)
+{
+    user_activity();
+}
+
+static void buddy_signed_on(PurpleBuddy *buddy)
+{
+    g_hash_table_foreach(ptts_backends, backend_foreach_warm, buddy);
+}
+
+static void buddy_gone(PurpleBuddy *buddy)
+{
+    g_hash_table_foreach(ptts_backends, backend_foreach_evict, buddy);
+}
+
+// pidgin also switches tabs for incoming messages, so this is no activity
+static void conversation_switched(PurpleConversation *conv)
+{
+    // warm up the shell before the first message arrives
+    if (ptts_sink != SINK_NULL && pref_get_prewarm() && conv_may_speak(conv))
+        backend_start(backend_for(conv));
+}
+
 
 // CLI {{{1
 static PurpleCmdRet ptts_command_keyword(
@@ -676,8 +4489,10 @@ static PurpleCmdRet ptts_command_keyword(
     if (args[0] == NULL || !purple_strequal(args[0], CMD_KEYWORD))
         return PURPLE_CMD_RET_CONTINUE;
 
-    else if (args[1] == NULL)   // list all keywords
+    else if (args[1] == NULL) { // list all keywords
         pref_log_keywords_active(conv);
+        pref_log_keywords_interrupt(conv);
+    }
 
     else if (args[2] == NULL)
     {
@@ -693,6 +4508,9 @@ static PurpleCmdRet ptts_command_keyword(
         else if (purple_strequal(args[1], CMD_KEYWORD_LIST))
             pref_log_keywords(conv);
 
+        else if (purple_strequal(args[1], CMD_KEYWORD_INTERRUPT))
+            pref_log_keywords_interrupt(conv);
+
         else
             return PURPLE_CMD_RET_FAILED;
     }
@@ -704,6 +4522,36 @@ static PurpleCmdRet ptts_command_keyword(
         else if (purple_strequal(args[1], CMD_KEYWORD_REMOVE))
             pref_delete_keyword(args[2]);
 
+        else if (purple_strequal(args[1], CMD_KEYWORD_INTERRUPT)) {
+            if (purple_strequal(args[2], CMD_KEYWORD_ENABLE))
+                pref_set_keywords_interrupt(TRUE);
+            else if (purple_strequal(args[2], CMD_KEYWORD_DISABLE))
+                pref_set_keywords_interrupt(FALSE);
+            else
+                return PURPLE_CMD_RET_FAILED;
+            pref_log_keywords_interrupt(conv);
+        }
+
+        else if (purple_strequal(args[1], CMD_IMPORT)) {
+            guint count;
+            if (!pref_import_keywords(args[2], &count))
+                return PURPLE_CMD_RET_FAILED;
+            systemlog(conv,
+                    "%s - imported %u keywords from: %s",
+                    PLUGIN_NAME,
+                    count,
+                    args[2]);
+        }
+
+        else if (purple_strequal(args[1], CMD_EXPORT)) {
+            if (!pref_export_keywords(args[2]))
+                return PURPLE_CMD_RET_FAILED;
+            systemlog(conv,
+                    "%s - exported keywords to: %s",
+                    PLUGIN_NAME,
+                    args[2]);
+        }
+
         else
             return PURPLE_CMD_RET_FAILED;
     }
@@ -721,8 +4569,59 @@ static PurpleCmdRet ptts_command_replace(
     if (args[0] == NULL || !purple_strequal(args[0], CMD_REPLACE))
         return PURPLE_CMD_RET_CONTINUE;
 
-    if (args[1] == NULL)
+    if (args[1] == NULL) {
         pref_log_replace(conv);
+        regex_log(conv, backend_ready(ptts_backend)->regex);
+    }
+    else if (purple_strequal(args[1], CMD_REPLACE_REGEX)) {
+        gchar **rule = args[2] ? g_strsplit(args[2], " ", 2) : NULL;
+        if (rule == NULL)
+            regex_log(conv, backend_ready(ptts_backend)->regex);
+        else if (rule[1] == NULL) {
+            if (pref_delete_regex(rule[0]))
+                systemlog(conv,
+                        "%s - deleted regex replacement for: %s",
+                        PLUGIN_NAME,
+                        rule[0]);
+        }
+        else if (pref_add_regex(rule[0], rule[1], error)) {
+            const gchar *reason = regex_skipped(backend_ready(ptts_backend)->regex, rule[0]);
+            if (reason != NULL)
+                systemlog(conv,
+                        "%s - added regex replacement for: %s, but it cannot be combined with the other rules: %s",
+                        PLUGIN_NAME,
+                        rule[0],
+                        reason);
+            else
+                systemlog(conv,
+                        "%s - added regex replacement for: %s",
+                        PLUGIN_NAME,
+                        rule[0]);
+        }
+        else {
+            g_strfreev(rule);
+            return PURPLE_CMD_RET_FAILED;
+        }
+        g_strfreev(rule);
+    }
+    else if (args[2] != NULL && purple_strequal(args[1], CMD_IMPORT)) {
+        guint count;
+        if (!pref_import_replace(args[2], &count))
+            return PURPLE_CMD_RET_FAILED;
+        systemlog(conv,
+                "%s - imported %u replacements from: %s",
+                PLUGIN_NAME,
+                count,
+                args[2]);
+    }
+    else if (args[2] != NULL && purple_strequal(args[1], CMD_EXPORT)) {
+        if (!pref_export_replace(args[2]))
+            return PURPLE_CMD_RET_FAILED;
+        systemlog(conv,
+                "%s - exported replacements to: %s",
+                PLUGIN_NAME,
+                args[2]);
+    }
     else if (args[2] == NULL) {
         pref_delete_replace(args[1]);
         systemlog(conv,
@@ -741,6 +4640,200 @@ static PurpleCmdRet ptts_command_replace(
     return PURPLE_CMD_RET_OK;
 }
 
+static PurpleCmdRet ptts_command_dict(
+        PurpleConversation *conv,
+        const gchar *cmd,
+        gchar **args,
+        gchar **error,
+        void *data)
+{
+    struct dict *dict;
+    gchar *source, *target;
+    guint count;
+
+    if (args[0] == NULL || !purple_strequal(args[0], CMD_DICT))
+        return PURPLE_CMD_RET_CONTINUE;
+
+    if (args[1] == NULL)
+        dict_log(conv, backend_ready(ptts_backend)->dict);
+
+    else if (purple_strequal(args[1], CMD_DICT_COMPILE)) {
+        // the source may contain spaces, the output file is the last word
+        source = args[2] ? g_strstrip(g_strdup(args[2])) : NULL;
+        target = source ? strrchr(source, ' ') : NULL;
+        if (target == NULL) {
+            g_free(source);
+            return PURPLE_CMD_RET_FAILED;
+        }
+        *target++ = 0;
+        g_strchomp(source);
+        if (!dict_compile(source, target, &count)) {
+            g_free(source);
+            return PURPLE_CMD_RET_FAILED;
+        }
+        systemlog(conv,
+                "%s - compiled %u entries into: %s",
+                PLUGIN_NAME,
+                count,
+                target);
+        g_free(source);
+    }
+
+    else if (purple_strequal(args[1], CMD_DICT_DISABLE)) {
+        pref_set_dictionary("");
+        dict_log(conv, backend_ready(ptts_backend)->dict);
+    }
+
+    else if (args[2] == NULL) {
+        dict = dict_open(args[1]);
+        if (dict == NULL)
+            return PURPLE_CMD_RET_FAILED;
+        dict_close(dict);
+
+        // reload even if the same file was compiled anew
+        pref_set_dictionary(args[1]);
+        ptts_backend->compiled = FALSE;
+        dict_log(conv, backend_ready(ptts_backend)->dict);
+    }
+
+    else
+        return PURPLE_CMD_RET_FAILED;
+
+    return PURPLE_CMD_RET_OK;
+}
+
+static PurpleCmdRet ptts_command_condense(
+        PurpleConversation *conv,
+        const gchar *cmd,
+        gchar **args,
+        gchar **error,
+        void *data)
+{
+    gboolean value;
+
+    if (args[0] == NULL || !purple_strequal(args[0], CMD_CONDENSE))
+        return PURPLE_CMD_RET_CONTINUE;
+
+    if (args[1] == NULL) {
+        pref_log_condense(conv);
+        return PURPLE_CMD_RET_OK;
+    }
+
+    if (purple_strequal(args[1], CMD_CONDENSE_URLS))
+        value = pref_get_condense_urls();
+    else if (purple_strequal(args[1], CMD_CONDENSE_CODE))
+        value = pref_get_condense_code();
+    else if (purple_strequal(args[1], CMD_CONDENSE_EMOJI))
+        value = pref_get_condense_emoji();
+    else
+        return PURPLE_CMD_RET_FAILED;
+
+    if (args[2] == NULL) {
+        systemlog(conv,
+                "%s condenses %s: %s",
+                PLUGIN_NAME,
+                args[1],
+                value ? "on" : "off");
+        return PURPLE_CMD_RET_OK;
+    }
+
+    if (purple_strequal(args[2], CMD_ENABLE))
+        value = TRUE;
+    else if (purple_strequal(args[2], CMD_DISABLE))
+        value = FALSE;
+    else
+        return PURPLE_CMD_RET_FAILED;
+
+    if (purple_strequal(args[1], CMD_CONDENSE_URLS))
+        pref_set_condense_urls(value);
+    else if (purple_strequal(args[1], CMD_CONDENSE_CODE))
+        pref_set_condense_code(value);
+    else if (purple_strequal(args[1], CMD_CONDENSE_EMOJI))
+        pref_set_condense_emoji(value);
+
+    pref_log_condense(conv);
+    return PURPLE_CMD_RET_OK;
+}
+
+static PurpleCmdRet ptts_command_trace(
+        PurpleConversation *conv,
+        const gchar *cmd,
+        gchar **args,
+        gchar **error,
+        void *data)
+{
+    gdouble speed = 1.0;
+    gchar *end;
+
+    if (args[0] == NULL)
+        return PURPLE_CMD_RET_CONTINUE;
+
+    else if (purple_strequal(args[0], CMD_RECORD)) {
+        if (args[1] == NULL)
+            systemlog(conv,
+                    "%s is %srecording messages",
+                    PLUGIN_NAME,
+                    ptts_trace_file ? "" : "not ");
+
+        else if (purple_strequal(args[1], CMD_RECORD_STOP)) {
+            trace_stop();
+            systemlog(conv, "%s stopped recording messages", PLUGIN_NAME);
+        }
+
+        else if (trace_start(args[1]))
+            systemlog(conv,
+                    "%s - recording messages to: %s",
+                    PLUGIN_NAME,
+                    args[1]);
+
+        else
+            return PURPLE_CMD_RET_FAILED;
+    }
+
+    else if (purple_strequal(args[0], CMD_REPLAY)) {
+        if (args[1] == NULL) {
+            trace_replay_stop();
+            return PURPLE_CMD_RET_OK;
+        }
+
+        if (args[2] != NULL && !purple_strequal(args[2], CMD_REPLAY_MAX)) {
+            // 0 means as fast as possible, which only "max" asks for
+            speed = g_ascii_strtod(args[2], &end);
+            if (end == args[2] || *end != 0 || !(speed > 0 && speed <= G_MAXDOUBLE))
+                return PURPLE_CMD_RET_FAILED;
+        }
+        else if (args[2] != NULL)
+            speed = 0;
+
+        if (!trace_replay_start(conv, args[1], speed))
+            return PURPLE_CMD_RET_FAILED;
+
+        systemlog(conv,
+                "%s - replaying: %s",
+                PLUGIN_NAME,
+                args[1]);
+    }
+
+    else if (purple_strequal(args[0], CMD_SINK)) {
+        if (args[1] == NULL)
+            ;
+        else if (purple_strequal(args[1], CMD_SINK_SHELL))
+            sink_set(SINK_SHELL, NULL);
+        else if (purple_strequal(args[1], CMD_SINK_NULL))
+            sink_set(SINK_NULL, NULL);
+        else if (purple_strequal(args[1], CMD_SINK_WAV) && args[2] != NULL)
+            sink_set(SINK_WAV, args[2]);
+        else
+            return PURPLE_CMD_RET_FAILED;
+        sink_log(conv);
+    }
+
+    else
+        return PURPLE_CMD_RET_CONTINUE;
+
+    return PURPLE_CMD_RET_OK;
+}
+
 static PurpleCmdRet ptts_command_conv(
         PurpleConversation *conv,
         const gchar *cmd,
@@ -770,6 +4863,20 @@ static PurpleCmdRet ptts_command_conv(
         conv_log_active(conv);
     }
 
+    else if (purple_strequal(args[1], CMD_CONV_PROFILE)) {
+        if (args[2] == NULL)
+            conv_set_backend(conv, NULL);
+        else {
+            if (!profile_exists(args[2]))
+                profile_init(args[2], PROFILE_ESPEAK_BACKEND);
+            conv_set_backend(conv, backend_get(args[2]));
+        }
+        systemlog(conv,
+                "%s profile for this conversation is: %s",
+                PLUGIN_NAME,
+                backend_for(conv)->name);
+    }
+
     else
         return PURPLE_CMD_RET_FAILED;
 
@@ -813,15 +4920,52 @@ static PurpleCmdRet ptts_command(
             else if (purple_strequal(args[0], CMD_COMPOSE))
                 pref_log_compose(conv);
 
+            else if (purple_strequal(args[0], CMD_IDLE))
+                pref_log_idle_timeout(conv);
+
+            else if (purple_strequal(args[0], CMD_FOCUS))
+                pref_log_focus(conv);
+
+            else if (purple_strequal(args[0], CMD_ACTIVITY))
+                pref_log_activity(conv);
+
+            else if (purple_strequal(args[0], CMD_METRICS))
+                pref_log_metrics(conv);
+
+            else if (purple_strequal(args[0], CMD_BACKEND))
+                pref_log_backend(conv);
+
+            else if (purple_strequal(args[0], CMD_SOCKET))
+                pref_log_socket(conv);
+
+            else if (purple_strequal(args[0], CMD_ANNOUNCE))
+                pref_log_announce(conv);
+
+            else if (purple_strequal(args[0], CMD_STOP))
+                g_hash_table_foreach(ptts_backends, backend_foreach_cancel, NULL);
+
             else if (purple_strequal(args[0], CMD_STATUS)) {
                 pref_log_active(conv);
                 conv_log_active(conv);
                 pref_log_shell(conv);
+                pref_log_idle_timeout(conv);
+                pref_log_focus(conv);
+                pref_log_activity(conv);
+                presence_log(conv);
+                pref_log_metrics(conv);
                 pref_log_command(conv);
                 pref_log_compose(conv);
+                pref_log_backend(conv);
+                pref_log_socket(conv);
+                pref_log_announce(conv);
+                pref_log_condense(conv);
                 pref_log_keywords_active(conv);
                 pref_log_keywords(conv);
                 pref_log_replace(conv);
+                regex_log(conv, backend_ready(ptts_backend)->regex);
+                arena_log(conv, &ptts_arena);
+                dict_log(conv, backend_ready(ptts_backend)->dict);
+                g_hash_table_foreach(ptts_backends, backend_foreach_log, conv);
             }
 
             else
@@ -830,11 +4974,77 @@ static PurpleCmdRet ptts_command(
         else
         {
             if (purple_strequal(args[0], CMD_SHELL)) {
+                g_hash_table_foreach(ptts_backends, backend_foreach_stop, NULL);
                 pref_set_shell(args[1]);
                 pref_log_shell(conv);
             }
 
+            else if (purple_strequal(args[0], CMD_BACKEND)) {
+                if (!purple_strequal(args[1], BACKEND_SHELL_NAME)
+                        && !purple_strequal(args[1], BACKEND_HELPER_NAME)
+                        && !purple_strequal(args[1], BACKEND_SSIP_NAME))
+                    return PURPLE_CMD_RET_FAILED;
+                pref_set_backend(args[1]);
+                pref_log_backend(conv);
+            }
+
+            else if (purple_strequal(args[0], CMD_SOCKET)) {
+                if (strlen(args[1]) >= sizeof(((struct sockaddr_un*) NULL)->sun_path))
+                    return PURPLE_CMD_RET_FAILED;
+                pref_set_socket(args[1]);
+                pref_log_socket(conv);
+            }
+
+            else if (purple_strequal(args[0], CMD_ANNOUNCE)) {
+                if (purple_strequal(args[1], CMD_ENABLE))
+                    pref_set_announce(TRUE);
+                else if (purple_strequal(args[1], CMD_DISABLE))
+                    pref_set_announce(FALSE);
+                else
+                    return PURPLE_CMD_RET_FAILED;
+                pref_log_announce(conv);
+            }
+
+            else if (purple_strequal(args[0], CMD_FOCUS)) {
+                if (purple_strequal(args[1], CMD_ENABLE))
+                    pref_set_focus(TRUE);
+                else if (purple_strequal(args[1], CMD_DISABLE))
+                    pref_set_focus(FALSE);
+                else
+                    return PURPLE_CMD_RET_FAILED;
+                pref_log_focus(conv);
+            }
+
+            else if (purple_strequal(args[0], CMD_ACTIVITY)) {
+                gint seconds;
+                if (!parse_seconds(args[1], &seconds))
+                    return PURPLE_CMD_RET_FAILED;
+                pref_set_activity(seconds);
+                pref_log_activity(conv);
+            }
+
+            else if (purple_strequal(args[0], CMD_METRICS)) {
+                const gchar *path = purple_strequal(args[1], CMD_DISABLE) ? "" : args[1];
+                if (!metrics_start(path)) {
+                    metrics_start(pref_get_metrics());
+                    return PURPLE_CMD_RET_FAILED;
+                }
+                pref_set_metrics(path);
+                pref_log_metrics(conv);
+            }
+
+            else if (purple_strequal(args[0], CMD_IDLE)) {
+                gint seconds;
+                if (!parse_seconds(args[1], &seconds))
+                    return PURPLE_CMD_RET_FAILED;
+                pref_set_idle_timeout(seconds);
+                g_hash_table_foreach(ptts_backends, backend_foreach_rearm, NULL);
+                pref_log_idle_timeout(conv);
+            }
+
             else if (purple_strequal(args[0], CMD_PROFILE)) {
+                if (!profile_exists(args[1]))
+                    profile_init(args[1], PROFILE_ESPEAK_BACKEND);
                 pref_set_profile(args[1]);
                 pref_log_profile(conv);
             }
@@ -861,14 +5071,16 @@ static PurpleCmdRet ptts_command(
 
             else if (purple_strequal(args[0], CMD_SAY)) {
                 gchar* text;
-                if (analyse(args[1], &text)) {
-                    tts(conv, text);
-                    g_free(text);
+                struct backend *backend = backend_for(conv);
+                arena_begin(&ptts_arena);
+                if (analyse(backend, args[1], &text)) {
+                    tts(backend, NULL, NULL, text, PRIORITY_NORMAL);
+                    arena_reset(&ptts_arena);
                 }
             }
 
             else if (purple_strequal(args[0], CMD_TEST)) {
-                if (process_message(conv, args[1]))
+                if (process_message(purple_conversation_get_account(conv), conv, NULL, args[1], FALSE))
                     systemlog(conv,
                             "%s - echoing test string...",
                             PLUGIN_NAME);
@@ -892,34 +5104,28 @@ static void ptts_plugin_init(PurplePlugin *plugin)
 
     pref_add_active(DEFAULT_ACTIVE);
     pref_add_shell(DEFAULT_SHELL);
+    pref_add_idle_timeout(DEFAULT_IDLE_TIMEOUT);
+    pref_add_prewarm(DEFAULT_PREWARM);
+    pref_add_focus(DEFAULT_FOCUS);
+    pref_add_activity(DEFAULT_ACTIVITY);
+    pref_add_metrics(DEFAULT_METRICS);
     pref_add_profile(DEFAULT_PROFILE);
 
-    char* str = g_strdup_printf(PREFS_PROFILES, PROFILE_ESPEAK);
-    purple_prefs_add_none(str);
-    g_free(str);
-
-    pref_add_command(PROFILE_ESPEAK_COMMAND);
-    pref_add_compose(PROFILE_ESPEAK_COMPOSE);
-
-    gchar* language = detect_language();
-    pref_add_language(language);
-    free(language);
-
-    pref_add_volume(PROFILE_ESPEAK_VOLUME);
-
-    pref_add_replacement(PROFILE_ESPEAK_REPLACE);
-    pref_add_keywords(PROFILE_ESPEAK_KEYWORDS);
-    pref_add_keywords_active(PROFILE_ESPEAK_KEYS_ON);
+    profile_init(PROFILE_ESPEAK, PROFILE_ESPEAK_BACKEND);
+    profile_init(PROFILE_SPEECHD, PROFILE_SPEECHD_BACKEND);
 }
 
 static gboolean ptts_plugin_load(PurplePlugin *plugin)
 {
     void *conv_handle = purple_conversations_get_handle();
     gchar
-        *info_keyword = "/"CMD_TTS" keyword [add &lt;keyword&gt; | remove &lt;keyword&gt;]",
-        *info_replace = "/"CMD_TTS" replace &lt;word&gt; &lt;replacement&gt;",
-        *info = "/"CMD_TTS" [on | off | compose &lt;command line composition&gt; | shell &lt;path&gt; | command &lt;path&gt; | say &lt;text&gt; | status]",
-        *info_stts = "/"CMD_TTS" buddy [on | off]";
+        *info_keyword = "/"CMD_TTS" keyword [add &lt;keyword&gt; | remove &lt;keyword&gt; | interrupt [on | off] | import &lt;file&gt; | export &lt;file&gt;]",
+        *info_replace = "/"CMD_TTS" replace [&lt;word&gt; &lt;replacement&gt; | -r &lt;pattern&gt; [&lt;replacement&gt;] | import &lt;file&gt; | export &lt;file&gt;]",
+        *info = "/"CMD_TTS" [on | off | compose &lt;command line composition&gt; | shell &lt;path&gt; | command &lt;path&gt; | backend [shell | helper | ssip] | socket &lt;path&gt; | announce [on | off] | focus [on | off] | activity &lt;seconds&gt; | metrics [&lt;socket&gt; | off] | idle &lt;seconds&gt; | say &lt;text&gt; | stop | status]",
+        *info_stts = "/"CMD_TTS" buddy [on | off | profile [&lt;name&gt;]]",
+        *info_dict = "/"CMD_TTS" dict [&lt;file&gt; | off | compile &lt;tsv file&gt; &lt;file&gt;]",
+        *info_condense = "/"CMD_TTS" condense [urls | code | emoji] [on | off]",
+        *info_trace = "/"CMD_TTS" [record &lt;file&gt; | record off | replay &lt;file&gt; [&lt;speed&gt; | max] | sink [shell | null | wav &lt;dir&gt;]]";
 
     PurpleCmdFlag flags =
         PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT
@@ -928,8 +5134,25 @@ static gboolean ptts_plugin_load(PurplePlugin *plugin)
 
     ptts_instance = plugin;
 
-    // start child process
-    ptts_queue_pid = spawn(pref_get_shell(), NULL, 0, &ptts_queue_stdin, NULL);
+    // heap allocations are only counted when the counter is preloaded
+    ptts_malloc_count = dlsym(RTLD_DEFAULT, MALLOC_COUNT_SYMBOL);
+
+    ptts_scan_init(&scan_markup);
+    ptts_scan_add(&scan_markup, '<');
+    ptts_scan_add(&scan_markup, '&');
+    ptts_scan_init(&scan_strip);
+    ptts_scan_add(&scan_strip, '\'');
+    ptts_scan_add(&scan_strip, '\n');
+    purple_debug_info(PLUGIN_NAME, "scanning messages with %s\n", ptts_scan_name());
+
+    // counters are kept anyway, serving them is opt-in
+    metrics_start(pref_get_metrics());
+
+    // profiles are compiled on first use
+    ptts_backends = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, backend_free);
+    conv_backends = g_hash_table_new(g_direct_hash, g_direct_equal);
+    ptts_backend = backend_get(pref_get_profile());
+    purple_prefs_connect_callback(plugin, PREFS_PROFILE, backend_pref_changed, NULL);
 
     // register command handlers
     ptts_command_id_global = purple_cmd_register(
@@ -968,16 +5191,58 @@ static gboolean ptts_plugin_load(PurplePlugin *plugin)
             ptts_command_replace,               // Name of the callback function
             info_replace,                       // Help message
             NULL );                             // Any special user-defined data
+    ptts_command_id_trace = purple_cmd_register(
+            CMD_TTS,                            // command name
+            "wws",                              // command argument format
+            PURPLE_CMD_P_DEFAULT,               // command priority flags
+            flags,                              // command usage flags
+            PLUGIN_ID,                          // Plugin ID
+            ptts_command_trace,                 // Name of the callback function
+            info_trace,                         // Help message
+            NULL );                             // Any special user-defined data
+    ptts_command_id_dict = purple_cmd_register(
+            CMD_TTS,                            // command name
+            "wws",                              // command argument format
+            PURPLE_CMD_P_DEFAULT,               // command priority flags
+            flags,                              // command usage flags
+            PLUGIN_ID,                          // Plugin ID
+            ptts_command_dict,                  // Name of the callback function
+            info_dict,                          // Help message
+            NULL );                             // Any special user-defined data
+    ptts_command_id_condense = purple_cmd_register(
+            CMD_TTS,                            // command name
+            "wws",                              // command argument format
+            PURPLE_CMD_P_DEFAULT,               // command priority flags
+            flags,                              // command usage flags
+            PLUGIN_ID,                          // Plugin ID
+            ptts_command_condense,              // Name of the callback function
+            info_condense,                      // Help message
+            NULL );                             // Any special user-defined data
 
 
     // TODO: add commands to show/edit replacement table !!
-    // TODO: add command to stop espeak output and clear shell input buffer !!
 
     // register message handler
     purple_signal_connect(conv_handle, "received-im-msg",
             plugin, PURPLE_CALLBACK(message_receive), NULL);
     purple_signal_connect(conv_handle, "received-chat-msg",
             plugin, PURPLE_CALLBACK(message_receive), NULL);
+    purple_signal_connect(conv_handle, "sent-im-msg",
+            plugin, PURPLE_CALLBACK(message_sent), NULL);
+    purple_signal_connect(conv_handle, "sent-chat-msg",
+            plugin, PURPLE_CALLBACK(message_sent), NULL);
+    purple_signal_connect(conv_handle, "deleting-conversation",
+            plugin, PURPLE_CALLBACK(trace_conversation_deleted), NULL);
+    purple_signal_connect(conv_handle, "deleting-conversation",
+            plugin, PURPLE_CALLBACK(conv_deleted), NULL);
+    purple_signal_connect(pidgin_conversations_get_handle(), "conversation-switched",
+            plugin, PURPLE_CALLBACK(conversation_switched), NULL);
+    purple_signal_connect(purple_blist_get_handle(), "buddy-signed-on",
+            plugin, PURPLE_CALLBACK(buddy_signed_on), NULL);
+    purple_signal_connect(purple_blist_get_handle(), "buddy-signed-off",
+            plugin, PURPLE_CALLBACK(buddy_gone), NULL);
+    purple_signal_connect(purple_blist_get_handle(), "buddy-removed",
+            plugin, PURPLE_CALLBACK(buddy_gone), NULL);
 
     // print some debug info
     purple_debug_info(PLUGIN_NAME, "loaded\n");
@@ -994,16 +5259,35 @@ static gboolean ptts_plugin_unload(PurplePlugin * plugin)
     purple_cmd_unregister(ptts_command_id_conversation);
     purple_cmd_unregister(ptts_command_id_keyword);
     purple_cmd_unregister(ptts_command_id_replace);
+    purple_cmd_unregister(ptts_command_id_trace);
+    purple_cmd_unregister(ptts_command_id_dict);
+    purple_cmd_unregister(ptts_command_id_condense);
 
     // unregister message handler
     purple_signal_disconnect(conv_handle, "received-im-msg", plugin, PURPLE_CALLBACK(message_receive));
     purple_signal_disconnect(conv_handle, "received-chat-msg", plugin, PURPLE_CALLBACK(message_receive));
-
-    // close connection to child
-    close(ptts_queue_stdin);
-    // TODO: wait for child?
-    ptts_queue_stdin = 0;
-    ptts_queue_pid =0;
+    purple_signal_disconnect(conv_handle, "sent-im-msg", plugin, PURPLE_CALLBACK(message_sent));
+    purple_signal_disconnect(conv_handle, "sent-chat-msg", plugin, PURPLE_CALLBACK(message_sent));
+    purple_signal_disconnect(conv_handle, "deleting-conversation", plugin, PURPLE_CALLBACK(trace_conversation_deleted));
+    purple_signal_disconnect(conv_handle, "deleting-conversation", plugin, PURPLE_CALLBACK(conv_deleted));
+    purple_signal_disconnect(pidgin_conversations_get_handle(), "conversation-switched", plugin, PURPLE_CALLBACK(conversation_switched));
+    purple_signal_disconnect(purple_blist_get_handle(), "buddy-signed-on", plugin, PURPLE_CALLBACK(buddy_signed_on));
+    purple_signal_disconnect(purple_blist_get_handle(), "buddy-signed-off", plugin, PURPLE_CALLBACK(buddy_gone));
+    purple_signal_disconnect(purple_blist_get_handle(), "buddy-removed", plugin, PURPLE_CALLBACK(buddy_gone));
+
+    // stop serving metrics, recording and replaying
+    metrics_stop();
+    trace_stop();
+    trace_replay_stop();
+    sink_set(SINK_SHELL, NULL);
+
+    // close connection to children, they are reaped by glib
+    purple_prefs_disconnect_by_handle(plugin);
+    g_hash_table_destroy(conv_backends);
+    g_hash_table_destroy(ptts_backends);
+    conv_backends = ptts_backends = NULL;
+    ptts_backend = NULL;
+    arena_free(&ptts_arena);
 
     // print some debug info:
     purple_debug_info(PLUGIN_NAME, "unloaded\n");
@@ -0,0 +1,101 @@
+/*
+ * File:        ptts-malloc-count.c
+ * Author:      Thomas Gläßle
+ * License:     free
+ *
+ * Description:
+ * Counts the heap allocations of every thread, so pidgin-tts can show how
+ * many the processing of a message really needed: its own, and those of
+ * glib, libpurple and everything else on the way. The plugin looks up
+ * ptts_malloc_count() when it is loaded and falls back to not measuring
+ * if the library is not preloaded.
+ *
+ * Usage:
+ *  LD_PRELOAD=./ptts-malloc-count.so pidgin
+ *
+ * Only for glibc, which exports its allocator as __libc_malloc & co.
+ */
+
+# ifdef _WIN32
+#   error "This will probably not work on Windows!"
+# endif
+
+// system includes {{{1
+# include <stddef.h>
+# include <stdint.h>
+# include <errno.h>
+
+// glibc allocator {{{1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+
+// counter {{{1
+static __thread uint64_t count;
+
+uint64_t ptts_malloc_count(void)
+{
+    return count;
+}
+
+// allocation functions {{{1
+void *malloc(size_t size)
+{
+    ++count;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    ++count;
+    return __libc_calloc(n, size);
+}
+
+// shrinking in place is an allocation all the same
+void *realloc(void *ptr, size_t size)
+{
+    ++count;
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    ++count;
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    ++count;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    ++count;
+    p = __libc_memalign(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+    *ptr = p;
+    return 0;
+}
+
+void *valloc(size_t size)
+{
+    ++count;
+    return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size)
+{
+    ++count;
+    return __libc_pvalloc(size);
+}
+// 1}}}
@@ -0,0 +1,156 @@
+/*
+ * File:        ptts-ring.h
+ * Author:      Thomas Gläßle
+ * License:     free
+ *
+ * Description:
+ * Shared memory layout used between pidgin-tts and pidgin-tts-helper.
+ * The mapping holds two single producer, single consumer ring buffers of
+ * length-prefixed records: requests from the plugin to the helper, and
+ * responses (PCM, completion) back. Either side signals new records
+ * through an eventfd.
+ */
+
+# ifndef PTTS_RING_H
+# define PTTS_RING_H
+
+# include <stdint.h>
+# include <string.h>
+
+# define PTTS_SHM_MAGIC         0x53545450u     /* "PTTS" */
+# define PTTS_SHM_VERSION       3
+# define PTTS_CACHELINE         64
+
+// ring records are prefixed by their length and aligned to 4 bytes. A
+// length of PTTS_RING_WRAP tells the consumer to continue at offset 0.
+# define PTTS_RING_WRAP         0xffffffffu
+# define PTTS_RING_ALIGN(n)     (((n) + 3u) & ~3u)
+
+// message types
+# define PTTS_MSG_VOICE         1   // plugin: language follows, arg is the volume
+# define PTTS_MSG_SPEAK         2   // plugin: text follows
+# define PTTS_MSG_PCM           3   // helper: samples follow, arg is the sample rate
+# define PTTS_MSG_DONE          4   // helper: utterance id is finished
+# define PTTS_MSG_WARM          5   // plugin: who and name follow, render the name clip when idle
+# define PTTS_MSG_EVICT         6   // plugin: who follows, drop the name clips
+
+// message flags
+# define PTTS_FLAG_PCM          1   // send the samples back instead of playing them
+# define PTTS_FLAG_SENDER       2   // SPEAK: who, name and text follow, the name clip goes first
+
+// DONE: arg tells whether the name clip was cached
+# define PTTS_DONE_CLIP_HIT     1
+# define PTTS_DONE_CLIP_MISS    2
+
+// strings in a record are NUL terminated and follow each other
+
+struct ptts_msg {
+    uint32_t type;
+    uint32_t id;
+    uint32_t flags;
+    uint32_t arg;
+};
+
+struct ptts_ring {
+    uint32_t size;          // bytes of data, a power of two
+    uint32_t offset;        // of the data, from the start of the mapping
+    char pad0[PTTS_CACHELINE - 8];
+    uint32_t head;          // written by the producer only
+    char pad1[PTTS_CACHELINE - 4];
+    uint32_t tail;          // written by the consumer only
+    char pad2[PTTS_CACHELINE - 4];
+};
+
+struct ptts_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          // of the whole mapping
+    uint32_t cancel;        // id of an utterance to cut short, written by the plugin
+    char pad[PTTS_CACHELINE - 16];
+    struct ptts_ring request;
+    struct ptts_ring response;
+};
+
+// lay out both rings behind the header, returns the required mapping size
+static inline uint32_t ptts_shm_layout(struct ptts_shm *shm, uint32_t request_size, uint32_t response_size)
+{
+    uint32_t offset = sizeof(struct ptts_shm);
+
+    if (shm != NULL) {
+        memset(shm, 0, sizeof(*shm));
+        shm->magic = PTTS_SHM_MAGIC;
+        shm->version = PTTS_SHM_VERSION;
+        shm->request.size = request_size;
+        shm->request.offset = offset;
+        shm->response.size = response_size;
+        shm->response.offset = offset + request_size;
+        shm->size = offset + request_size + response_size;
+    }
+    return offset + request_size + response_size;
+}
+
+// append a record made of two parts, returns 0 if there is no room
+static inline int ptts_ring_push(
+        struct ptts_shm *shm, struct ptts_ring *ring,
+        const void *a, uint32_t alen,
+        const void *b, uint32_t blen)
+{
+    unsigned char *data = (unsigned char*) shm + ring->offset;
+    uint32_t size = ring->size;
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t len = alen + blen;
+    uint32_t need = PTTS_RING_ALIGN(4 + len);
+    uint32_t pos = head & (size - 1);
+    uint32_t skip = size - pos < need ? size - pos : 0;
+
+    if (need > size / 2 || size - (head - tail) < skip + need)
+        return 0;
+
+    if (skip) {
+        uint32_t wrap = PTTS_RING_WRAP;
+        memcpy(data + pos, &wrap, 4);
+        head += skip;
+        pos = 0;
+    }
+
+    memcpy(data + pos, &len, 4);
+    memcpy(data + pos + 4, a, alen);
+    if (blen)
+        memcpy(data + pos + 4 + alen, b, blen);
+
+    __atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// oldest record, left in place until ptts_ring_consume. NULL if empty.
+static inline const void* ptts_ring_peek(struct ptts_shm *shm, struct ptts_ring *ring, uint32_t *len)
+{
+    const unsigned char *data = (const unsigned char*) shm + ring->offset;
+    uint32_t size = ring->size;
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t pos, n;
+
+    while (tail != head) {
+        pos = tail & (size - 1);
+        memcpy(&n, data + pos, 4);
+        if (n == PTTS_RING_WRAP) {
+            tail += size - pos;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (n > size - pos - 4)
+            return NULL;    // corrupt
+        *len = n;
+        return data + pos + 4;
+    }
+    return NULL;
+}
+
+static inline void ptts_ring_consume(struct ptts_ring *ring, uint32_t len)
+{
+    __atomic_store_n(&ring->tail, ring->tail + PTTS_RING_ALIGN(4 + len), __ATOMIC_RELEASE);
+}
+
+# endif /* PTTS_RING_H */
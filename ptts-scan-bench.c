@@ -0,0 +1,147 @@
+/*
+ * File:        ptts-scan-bench.c
+ * Author:      Thomas Gläßle
+ * License:     free
+ *
+ * Description:
+ * Throughput of the ptts-scan.h implementations on a large pasted message,
+ * with the scan sets pidgin-tts uses: markup, bytes to strip and keyword
+ * lead bytes. Every implementation must find the same candidates.
+ *
+ * Usage:
+ *  ptts-scan-bench [<megabytes> [<rounds>]]
+ */
+
+// system includes {{{1
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <time.h>
+
+// local includes {{{1
+# include "ptts-scan.h"
+
+// settings {{{1
+# define DEFAULT_SIZE_MB        8
+# define DEFAULT_ROUNDS         5
+
+// a chat message that was pasted in from somewhere else
+static const char *lines[] = {
+    "I think the build broke again after the last merge, can somebody have a look?",
+    "the deploy finished without errors but the dashboard still shows the old version",
+    "<b>note</b> the meeting is moved to Thursday &amp; will be in the small room",
+    "it's the same stack trace as yesterday, only the line numbers are different",
+    "please ping me when the Oncall rotation is updated",
+};
+
+static const char *keywords[] = { "oncall", "!outage", "deploy", "Pidgin" };
+
+// Helpers {{{1
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char* message(size_t size)
+{
+    char *text = malloc(size + 1);
+    size_t len = 0, n;
+    unsigned i = 0;
+
+    while (len < size) {
+        n = strlen(lines[i % 5]);
+        if (n > size - len)
+            n = size - len;
+        memcpy(text + len, lines[i++ % 5], n);
+        len += n;
+        if (len < size)
+            text[len++] = (i % 7) ? ' ' : '\n';
+    }
+    text[size] = 0;
+    return text;
+}
+
+// candidates of scan in text, the way pidgin-tts walks them
+static size_t candidates(const struct ptts_scan *scan, const char *text, size_t len)
+{
+    struct ptts_scan_cursor cursor;
+    size_t count = 0;
+
+    ptts_scan_start(&cursor, text, len);
+    while (ptts_scan_next(scan, &cursor) < len)
+        ++count;
+    return count;
+}
+
+// the same with ptts_scan_find, as used for sparse sets
+static size_t candidates_find(const struct ptts_scan *scan, const char *text, size_t len)
+{
+    size_t i, count = 0;
+
+    for (i = 0; (i += ptts_scan_find(scan, text + i, len - i)) < len; ++i)
+        ++count;
+    return count;
+}
+
+// Main {{{1
+int main(int argc, char **argv)
+{
+    struct ptts_scan sets[3];
+    const char *names[3] = { "markup", "strip", "keywords" };
+    size_t size = (argc > 1 ? atoi(argv[1]) : DEFAULT_SIZE_MB) * 1024 * 1024;
+    int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+    size_t expected[3], count;
+    char *text = message(size);
+    const char *k;
+    double start, best;
+    unsigned impl, s, i;
+    int r, status = 0;
+
+    ptts_scan_init(&sets[0]);
+    ptts_scan_add(&sets[0], '<');
+    ptts_scan_add(&sets[0], '&');
+    ptts_scan_init(&sets[1]);
+    ptts_scan_add(&sets[1], '\'');
+    ptts_scan_add(&sets[1], '\n');
+    ptts_scan_init(&sets[2]);
+    for (i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i) {
+        k = keywords[i] + (keywords[i][0] == '!');
+        ptts_scan_add_nocase(&sets[2], *k);
+    }
+
+    printf("%zu MB, best of %d rounds, default: %s\n", size >> 20, rounds, ptts_scan_name());
+
+    for (impl = PTTS_SCAN_IMPLS; impl-- > 0; ) {
+        if (!ptts_scan_select(ptts_scan_impls[impl].name)) {
+            printf("%-8s not supported\n", ptts_scan_impls[impl].name);
+            continue;
+        }
+        for (s = 0; s < 3; ++s) {
+            best = 0;
+            count = 0;
+            for (r = 0; r < rounds; ++r) {
+                start = now_s();
+                count = s < 2 ? candidates_find(&sets[s], text, size) : candidates(&sets[s], text, size);
+                if (r == 0 || now_s() - start < best)
+                    best = now_s() - start;
+            }
+
+            if (impl == PTTS_SCAN_IMPLS - 1)
+                expected[s] = count;
+            else if (count != expected[s])
+                status = 1;
+            printf("%-8s %-8s %9zu candidates %8.0f MB/s%s\n",
+                    ptts_scan_impls[impl].name,
+                    names[s],
+                    count,
+                    size / best / (1 << 20),
+                    count != expected[s] ? "  MISMATCH" : "");
+        }
+    }
+
+    free(text);
+    return status;
+}
+// 1}}}
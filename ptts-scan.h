@@ -0,0 +1,232 @@
+/*
+ * File:        ptts-scan.h
+ * Author:      Thomas Gläßle
+ * License:     free
+ *
+ * Description:
+ * First-byte filter used by pidgin-tts to skip the plain text of a message.
+ * A scan set holds a few bytes of interest (markup, characters to strip,
+ * keyword lead bytes); ptts_scan_find() returns the offset of the next one,
+ * so the scalar code only runs near candidates. Texts are scanned in blocks
+ * of 64 bytes into a bit mask of candidates, which a cursor hands out one
+ * by one. There are SSE2 and AVX2 implementations, picked on first use for
+ * the CPU at hand, and a scalar table lookup for everything else.
+ */
+
+# ifndef PTTS_SCAN_H
+# define PTTS_SCAN_H
+
+# include <stddef.h>
+# include <stdint.h>
+# include <string.h>
+
+# if defined(__x86_64__) || defined(__i386__)
+#   define PTTS_SCAN_X86
+#   include <immintrin.h>
+# endif
+
+// sets with more distinct bytes are scanned with the table only
+# define PTTS_SCAN_MAX          16
+# define PTTS_SCAN_BLOCK        64
+
+struct ptts_scan {
+    uint8_t table[256];             // nonzero for bytes in the set
+    uint8_t bytes[PTTS_SCAN_MAX];
+    unsigned count;                 // distinct bytes, may exceed PTTS_SCAN_MAX
+};
+
+// walks the candidates of a text one block at a time
+struct ptts_scan_cursor {
+    const char *text;
+    size_t len;
+    size_t block;                   // offset of the block mask belongs to
+    uint64_t mask;                  // candidates in it not returned yet
+};
+
+typedef uint64_t (*ptts_scan_fn)(const struct ptts_scan *scan, const char *p, size_t n);
+
+// set up
+static inline void ptts_scan_init(struct ptts_scan *scan)
+{
+    memset(scan, 0, sizeof(*scan));
+}
+
+static inline void ptts_scan_add(struct ptts_scan *scan, unsigned char c)
+{
+    if (scan->table[c])
+        return;
+    scan->table[c] = 1;
+    if (scan->count < PTTS_SCAN_MAX)
+        scan->bytes[scan->count] = c;
+    scan->count++;
+}
+
+// both cases of ASCII letters
+static inline void ptts_scan_add_nocase(struct ptts_scan *scan, unsigned char c)
+{
+    ptts_scan_add(scan, c);
+    if (c >= 'a' && c <= 'z')
+        ptts_scan_add(scan, c - 'a' + 'A');
+    else if (c >= 'A' && c <= 'Z')
+        ptts_scan_add(scan, c - 'A' + 'a');
+}
+
+// implementations, all of them return a bit mask of the bytes in the set
+// among the next n <= PTTS_SCAN_BLOCK bytes at p
+static uint64_t ptts_scan_scalar(const struct ptts_scan *scan, const char *p, size_t n)
+{
+    uint64_t mask = 0;
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+        if (scan->table[(uint8_t) p[i]])
+            mask |= (uint64_t) 1 << i;
+    return mask;
+}
+
+# ifdef PTTS_SCAN_X86
+__attribute__((target("sse2")))
+static uint64_t ptts_scan_sse2(const struct ptts_scan *scan, const char *p, size_t n)
+{
+    __m128i needle, block[4], hits[4];
+    uint64_t mask = 0;
+    unsigned i, k;
+
+    if (n < PTTS_SCAN_BLOCK || scan->count > PTTS_SCAN_MAX)
+        return ptts_scan_scalar(scan, p, n);
+
+    for (i = 0; i < 4; ++i) {
+        block[i] = _mm_loadu_si128((const __m128i*) (p + 16*i));
+        hits[i] = _mm_setzero_si128();
+    }
+    for (k = 0; k < scan->count; ++k) {
+        needle = _mm_set1_epi8((char) scan->bytes[k]);
+        for (i = 0; i < 4; ++i)
+            hits[i] = _mm_or_si128(hits[i], _mm_cmpeq_epi8(block[i], needle));
+    }
+    for (i = 0; i < 4; ++i)
+        mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(hits[i]) << (16*i);
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t ptts_scan_avx2(const struct ptts_scan *scan, const char *p, size_t n)
+{
+    __m256i needle, block[2], hits[2];
+    uint64_t mask = 0;
+    unsigned i, k;
+
+    if (n < PTTS_SCAN_BLOCK || scan->count > PTTS_SCAN_MAX)
+        return ptts_scan_scalar(scan, p, n);
+
+    for (i = 0; i < 2; ++i) {
+        block[i] = _mm256_loadu_si256((const __m256i*) (p + 32*i));
+        hits[i] = _mm256_setzero_si256();
+    }
+    for (k = 0; k < scan->count; ++k) {
+        needle = _mm256_set1_epi8((char) scan->bytes[k]);
+        for (i = 0; i < 2; ++i)
+            hits[i] = _mm256_or_si256(hits[i], _mm256_cmpeq_epi8(block[i], needle));
+    }
+    for (i = 0; i < 2; ++i)
+        mask |= (uint64_t) (uint32_t) _mm256_movemask_epi8(hits[i]) << (32*i);
+    return mask;
+}
+# endif
+
+// dispatch
+static const struct {
+    const char *name;
+    ptts_scan_fn fn;
+} ptts_scan_impls[] = {
+# ifdef PTTS_SCAN_X86
+    { "avx2",   ptts_scan_avx2 },
+    { "sse2",   ptts_scan_sse2 },
+# endif
+    { "scalar", ptts_scan_scalar },
+};
+
+# define PTTS_SCAN_IMPLS (sizeof(ptts_scan_impls) / sizeof(ptts_scan_impls[0]))
+
+static unsigned ptts_scan_current = PTTS_SCAN_IMPLS;
+
+static inline int ptts_scan_supported(unsigned impl)
+{
+# ifdef PTTS_SCAN_X86
+    __builtin_cpu_init();
+    if (ptts_scan_impls[impl].fn == ptts_scan_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (ptts_scan_impls[impl].fn == ptts_scan_sse2)
+        return __builtin_cpu_supports("sse2");
+# endif
+    return impl < PTTS_SCAN_IMPLS;
+}
+
+// use the named implementation, or the fastest the CPU supports for NULL.
+// Returns 0 if the name is unknown or not supported.
+static inline int ptts_scan_select(const char *name)
+{
+    unsigned i;
+
+    for (i = 0; i < PTTS_SCAN_IMPLS; ++i)
+        if ((name == NULL || strcmp(name, ptts_scan_impls[i].name) == 0) && ptts_scan_supported(i)) {
+            ptts_scan_current = i;
+            return 1;
+        }
+    return 0;
+}
+
+static inline const char* ptts_scan_name(void)
+{
+    if (ptts_scan_current == PTTS_SCAN_IMPLS)
+        ptts_scan_select(NULL);
+    return ptts_scan_impls[ptts_scan_current].name;
+}
+
+static inline uint64_t ptts_scan_block(const struct ptts_scan *scan, const char *p, size_t n)
+{
+    if (ptts_scan_current == PTTS_SCAN_IMPLS)
+        ptts_scan_select(NULL);
+    if (n > PTTS_SCAN_BLOCK)
+        n = PTTS_SCAN_BLOCK;
+    return scan->count ? ptts_scan_impls[ptts_scan_current].fn(scan, p, n) : 0;
+}
+
+// offset of the first byte in the set, or len
+static inline size_t ptts_scan_find(const struct ptts_scan *scan, const char *p, size_t len)
+{
+    uint64_t mask;
+    size_t i;
+
+    for (i = 0; i < len && scan->count; i += PTTS_SCAN_BLOCK)
+        if ((mask = ptts_scan_block(scan, p + i, len - i)) != 0)
+            return i + __builtin_ctzll(mask);
+    return len;
+}
+
+// for texts with many candidates, e.g. keyword lead bytes
+static inline void ptts_scan_start(struct ptts_scan_cursor *cursor, const char *text, size_t len)
+{
+    cursor->text = text;
+    cursor->len = len;
+    cursor->block = 0;
+    cursor->mask = 0;
+}
+
+// offset of the next candidate, or len
+static inline size_t ptts_scan_next(const struct ptts_scan *scan, struct ptts_scan_cursor *cursor)
+{
+    size_t offset;
+
+    while (cursor->mask == 0) {
+        if (cursor->block >= cursor->len || scan->count == 0)
+            return cursor->len;
+        cursor->mask = ptts_scan_block(scan, cursor->text + cursor->block, cursor->len - cursor->block);
+        cursor->block += PTTS_SCAN_BLOCK;
+    }
+    offset = cursor->block - PTTS_SCAN_BLOCK + __builtin_ctzll(cursor->mask);
+    cursor->mask &= cursor->mask - 1;
+    return offset;
+}
+
+# endif /* PTTS_SCAN_H */
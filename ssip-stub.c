@@ -0,0 +1,328 @@
+/*
+ * File:        ssip-stub.c
+ * Author:      Thomas Gläßle
+ * License:     free
+ *
+ * Description:
+ * Minimal stand-in for speech-dispatcher, to test the ssip backend of
+ * pidgin-tts without a system wide synthesizer. It listens on a UNIX
+ * socket, answers the subset of SSIP the plugin uses and "speaks" every
+ * message by printing it to stdout, taking a configurable time per
+ * character so cancellation and pipelining can be observed.
+ *
+ * Usage:
+ *  ssip-stub [-d <ms per character>] <socket path>
+ *
+ * Point a profile at it with
+ *  /tts profile speechd
+ *  /tts socket <socket path>
+ */
+
+# ifdef _WIN32
+#   error "This will probably not work on Windows!"
+# endif
+
+// system includes {{{1
+# include <stdio.h>
+# include <stdlib.h>
+# include <stdarg.h>
+# include <string.h>
+# include <strings.h>       // strncasecmp
+# include <unistd.h>
+# include <errno.h>
+# include <signal.h>
+# include <poll.h>
+# include <time.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+
+// settings {{{1
+# define MAX_CLIENTS            16
+# define LINE_MAX_LEN           4096
+
+// SET self PRIORITY
+# define PRIORITY_TEXT          0
+# define PRIORITY_MESSAGE       1
+# define PRIORITY_IMPORTANT     2
+
+static const char *priorities[] = { "", "(message) ", "(important) " };
+
+// state {{{1
+struct message {
+    struct message *next;
+    int client, id, priority;
+    char *text;
+};
+
+struct client {
+    int fd;
+    int receiving;          // between SPEAK and the terminating "."
+    int priority;
+    char line[LINE_MAX_LEN];
+    size_t line_len;
+    char *data;
+    size_t data_len;
+};
+
+static struct client clients[MAX_CLIENTS];
+static struct message *queue;
+static int next_id, delay_ms;
+static long long speaking_until;
+
+// Helpers {{{1
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void reply(struct client *c, const char *fmt, ...) __attribute__((format(printf,2,3)));
+static void reply(struct client *c, const char *fmt, ...)
+{
+    char buffer[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buffer, sizeof(buffer) - 2, fmt, ap);
+    va_end(ap);
+    if (len < 0 || len > (int) sizeof(buffer) - 2)
+        len = sizeof(buffer) - 2;
+    memcpy(buffer + len, "\r\n", 2);
+    if (write(c->fd, buffer, len + 2) < 0)
+        perror("write");
+}
+
+// Speech queue {{{1
+// "important" and "message" messages go before all "text" ones, and
+// "important" ones also interrupt the current message
+static void enqueue(struct client *c, char *text)
+{
+    struct message *msg = calloc(1, sizeof(*msg)), **p;
+
+    msg->client = c - clients;
+    msg->id = ++next_id;
+    msg->priority = c->priority;
+    msg->text = text;
+
+    if (msg->priority == PRIORITY_IMPORTANT && speaking_until && queue->priority < msg->priority) {
+        printf("[%d] interrupted\n", queue->id);
+        speaking_until = 0;
+    }
+    for (p = &queue; *p && (*p)->priority >= msg->priority; p = &(*p)->next)
+        ;
+    msg->next = *p;
+    *p = msg;
+
+    reply(c, "225-%d", msg->id);
+    reply(c, "225 OK MESSAGE QUEUED");
+}
+
+static void cancel(int client, int all)
+{
+    struct message **p = &queue, *msg;
+    int first = 1;
+
+    while ((msg = *p) != NULL) {
+        if (msg->client == client && (all || first)) {
+            printf("[%d] cancelled\n", msg->id);
+            *p = msg->next;
+            free(msg->text);
+            free(msg);
+        }
+        else
+            p = &msg->next;
+        first = 0;
+    }
+    speaking_until = 0;
+}
+
+// pop the current message once it is spoken, returns the poll timeout
+static int speak()
+{
+    struct message *msg;
+    long long now = now_ms();
+
+    while (queue != NULL) {
+        if (speaking_until == 0) {
+            printf("[%d] %s%s\n", queue->id, priorities[queue->priority], queue->text);
+            speaking_until = now + (long long) delay_ms * strlen(queue->text);
+        }
+        if (now < speaking_until)
+            return speaking_until - now;
+
+        msg = queue;
+        queue = msg->next;
+        free(msg->text);
+        free(msg);
+        speaking_until = 0;
+    }
+    return -1;
+}
+
+// Protocol {{{1
+static void command(struct client *c, char *line)
+{
+    char *arg;
+
+    if (c->receiving) {
+        if (strcmp(line, ".") == 0) {
+            c->receiving = 0;
+            enqueue(c, c->data ? c->data : strdup(""));
+            c->data = NULL;
+            c->data_len = 0;
+            return;
+        }
+        if (line[0] == '.' && line[1] == '.')
+            ++line;
+        c->data = realloc(c->data, c->data_len + strlen(line) + 2);
+        if (c->data_len)
+            c->data[c->data_len++] = ' ';
+        strcpy(c->data + c->data_len, line);
+        c->data_len += strlen(line);
+        return;
+    }
+
+    if (strncasecmp(line, "SPEAK", 5) == 0) {
+        c->receiving = 1;
+        reply(c, "230 OK RECEIVING DATA");
+    }
+    else if (strncasecmp(line, "CANCEL", 6) == 0) {
+        cancel(c - clients, 1);
+        reply(c, "210 OK CANCELED");
+    }
+    else if (strncasecmp(line, "STOP", 4) == 0) {
+        cancel(c - clients, 0);
+        reply(c, "210 OK STOPPED");
+    }
+    else if (strncasecmp(line, "SET self ", 9) == 0) {
+        arg = line + 9;
+        if (strncasecmp(arg, "CLIENT_NAME ", 12) == 0)
+            reply(c, "208 OK CLIENT NAME SET");
+        else if (strncasecmp(arg, "LANGUAGE ", 9) == 0)
+            reply(c, "201 OK LANGUAGE SET");
+        else if (strncasecmp(arg, "VOLUME ", 7) == 0)
+            reply(c, "218 OK VOLUME SET");
+        else if (strncasecmp(arg, "PRIORITY ", 9) == 0) {
+            arg += 9;
+            c->priority = strncasecmp(arg, "important", 9) == 0 ? PRIORITY_IMPORTANT
+                : strncasecmp(arg, "message", 7) == 0 ? PRIORITY_MESSAGE
+                : PRIORITY_TEXT;
+            reply(c, "202 OK PRIORITY SET");
+        }
+        else
+            reply(c, "300 ERR UNSUPPORTED");
+    }
+    else if (strncasecmp(line, "QUIT", 4) == 0) {
+        reply(c, "231 HAPPY HACKING");
+        shutdown(c->fd, SHUT_WR);
+    }
+    else
+        reply(c, "300 ERR INVALID COMMAND");
+}
+
+static void client_close(struct client *c)
+{
+    cancel(c - clients, 1);
+    close(c->fd);
+    free(c->data);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static void client_read(struct client *c)
+{
+    char buffer[1024], *eol;
+    ssize_t n = read(c->fd, buffer, sizeof(buffer));
+    size_t i;
+
+    if (n <= 0) {
+        client_close(c);
+        return;
+    }
+
+    for (i = 0; i < (size_t) n; ++i) {
+        if (c->line_len + 1 < sizeof(c->line))
+            c->line[c->line_len++] = buffer[i];
+        if (buffer[i] != '\n')
+            continue;
+
+        c->line[c->line_len] = 0;
+        if ((eol = strpbrk(c->line, "\r\n")) != NULL)
+            *eol = 0;
+        c->line_len = 0;
+        command(c, c->line);
+    }
+}
+
+// Main {{{1
+int main(int argc, char **argv)
+{
+    struct pollfd fds[MAX_CLIENTS + 1];
+    struct sockaddr_un addr;
+    int listener, i, n, timeout;
+
+    if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+        delay_ms = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "Usage: ssip-stub [-d <ms per character>] <socket path>\n");
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0
+            || bind(listener, (struct sockaddr*) &addr, sizeof(addr)) < 0
+            || listen(listener, MAX_CLIENTS) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    for (i = 0; i < MAX_CLIENTS; ++i)
+        clients[i].fd = -1;
+
+    for (;;) {
+        timeout = speak();
+
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (i = 0; i < MAX_CLIENTS; ++i) {
+            fds[i+1].fd = clients[i].fd;
+            fds[i+1].events = POLLIN;
+        }
+
+        n = poll(fds, MAX_CLIENTS + 1, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+        if (n <= 0)
+            continue;
+
+        for (i = 0; i < MAX_CLIENTS; ++i)
+            if (clients[i].fd >= 0 && fds[i+1].revents)
+                client_read(&clients[i]);
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            for (i = 0; i < MAX_CLIENTS && clients[i].fd >= 0; ++i)
+                ;
+            if (i < MAX_CLIENTS)
+                clients[i].fd = fd;
+            else if (fd >= 0)
+                close(fd);
+        }
+    }
+}
+// 1}}}